@@ -0,0 +1,307 @@
+#include <mupdf/fitz.h>
+#include <mupdf/pdf.h>
+#include <jansson.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "fill.h"
+
+// batch mode for the complete command. the template is parsed and the base pdf read into memory once,
+// then each line of the ndjson records file is filled into its own output pdf. each thread opens the pdf once
+// and rolls it back to a snapshot between records.
+
+
+static void batch_append(char *buf, int buflen, int *pos, const char *str, int len) {
+    while(len-- > 0 && *pos < buflen - 1) {
+        char c = *str++;
+        // keep record values from escaping the output directory
+        buf[(*pos)++] = (c == '/') ? '_' : c;
+    }
+}
+
+
+// expand the output name pattern. '%n' is the record number, '%{key}' the value of key in the record as text
+// and '%%' a literal '%'. returns 0 when the pattern references a key the record doesn't have, or whose value
+// is an object or array.
+int batch_output_name(const char *pattern, int record_num, json_t *record, char *buf, int buflen) {
+    char num_str[32];
+    int pos = 0;
+
+    while(*pattern && pos < buflen - 1) {
+        if(*pattern != '%') {
+            buf[pos++] = *pattern++;
+            continue;
+        }
+
+        pattern++;
+
+        if(*pattern == 'n') {
+            int len = snprintf(num_str, 32, "%d", record_num);
+            batch_append(buf, buflen, &pos, num_str, len);
+            pattern++;
+        } else if(*pattern == '{') {
+            const char *end = strchr(pattern, '}');
+            char key[256];
+            int keylen;
+
+            if(end == NULL || (keylen = end - pattern - 1) >= 256)
+                return 0;
+
+            memcpy(key, pattern + 1, keylen);
+            key[keylen] = 0;
+
+            json_t *val = json_object_get(record, key);
+            const char *str = num_str;
+            int len;
+
+            switch(json_typeof(val)) {
+                case JSON_STRING:
+                    str = json_string_value(val);
+                    len = strlen(str);
+                    break;
+
+                case JSON_INTEGER:
+                    len = snprintf(num_str, 32, "%" JSON_INTEGER_FORMAT, json_integer_value(val));
+                    break;
+
+                case JSON_REAL:
+                    len = snprintf(num_str, 32, "%.15g", json_real_value(val));
+                    break;
+
+                case JSON_TRUE:
+                case JSON_FALSE:
+                case JSON_NULL:
+                    str = json_is_true(val) ? "true" : json_is_false(val) ? "false" : "null";
+                    len = strlen(str);
+                    break;
+
+                default:
+                    return 0;
+            }
+
+            batch_append(buf, buflen, &pos, str, len);
+            pattern = end + 1;
+        } else if(*pattern == '%') {
+            buf[pos++] = *pattern++;
+        } else {
+            buf[pos++] = '%';
+        }
+    }
+
+    buf[pos] = 0;
+    return 1;
+}
+
+
+static char *batch_default_pattern(const char *input) {
+    int len = strlen(input);
+    char *pattern = malloc(len + 8);
+
+    if(len > 4 && strcmp(input + len - 4, ".pdf") == 0)
+        len -= 4;
+
+    memcpy(pattern, input, len);
+    memcpy(pattern + len, "_%n.pdf", 8);
+
+    return pattern;
+}
+
+
+static int batch_fill_doc(pdf_env *env, batch_env *benv, json_t *record) {
+    if(benv->plan)
+        return plan_fill_pages(env, benv->plan, record);
+    else if(benv->template)
+        return cmplt_fill_pages(env, benv->template, record);
+    else
+        return fld_fill_fields(env, record);
+}
+
+
+// --check-snapshot, result is record filled into the rolled back document. throws if filling it into a freshly
+// opened one saves differently
+static void batch_check_record(pdf_env *env, batch_env *benv, json_t *record, fz_buffer *result) {
+    doc_snapshot *snap = env->snapshot;
+    fz_buffer *fresh = NULL;
+    int same = 0;
+
+    // a signature's time and contents change on every save
+    if(env->add_sig)
+        return;
+
+    env->snapshot = NULL;
+
+    fz_var(fresh);
+    fz_try(env->ctx) {
+        unsigned char *data, *fresh_data;
+        size_t len = fz_buffer_storage(env->ctx, result, &data);
+
+        env->doc = cmplt_open_buffer(env->ctx, benv->base);
+        fresh = cmplt_save_buffer(env, benv->base, batch_fill_doc(env, benv, record));
+        same = fz_buffer_storage(env->ctx, fresh, &fresh_data) == len && memcmp(data, fresh_data, len) == 0;
+    } fz_always(env->ctx) {
+        fz_drop_buffer(env->ctx, fresh);
+    } fz_catch(env->ctx) {
+        cmplt_drop_doc(env);
+        env->snapshot = snap;
+        fz_rethrow(env->ctx);
+    }
+
+    env->snapshot = snap;
+
+    if(!same)
+        fz_throw(env->ctx, FZ_ERROR_GENERIC, "the snapshot's output differs from a freshly opened pdf's");
+}
+
+
+// fill one ndjson record into its own output. returns 1 when the record was filled
+int batch_fill_record(pdf_env *env, void *shared, work_item *item) {
+    batch_env *benv = shared;
+    json_error_t json_err;
+    char out_name[BATCH_NAME_LEN];
+    fz_buffer *result = NULL;
+    int filled = 0;
+
+    json_t *record = json_loads(item->line, 0, &json_err);
+
+    if(!json_is_object(record)) {
+        fprintf(stderr, "Skipping record on line %d: json root must be an object\n", item->line_num);
+        json_decref(record);
+        return 0;
+    }
+
+    if(!batch_output_name(benv->pattern, item->record_num, record, out_name, BATCH_NAME_LEN)) {
+        fprintf(stderr, "Skipping record on line %d: output name pattern '%s' uses a key missing from the record or holding an object or array\n", item->line_num, benv->pattern);
+        json_decref(record);
+        return 0;
+    }
+
+    env->files.output = out_name;
+    env->doc = NULL;
+
+    // each thread fills its records into one document, rolled back after each
+    if(env->snapshot == NULL)
+        env->snapshot = calloc(1, sizeof(doc_snapshot));
+
+    fz_var(result);
+    fz_try(env->ctx) {
+        env->doc = snap_open(env->ctx, env->snapshot, benv->base);
+
+        int updated_doc = batch_fill_doc(env, benv, record);
+
+        if(env->fill.check_snapshot) {
+            result = cmplt_save_buffer(env, benv->base, updated_doc);
+            batch_check_record(env, benv, record, result);
+
+            if(!cmplt_fwrite_buffer(env->ctx, result, env->files.output))
+                fz_throw(env->ctx, FZ_ERROR_GENERIC, "cannot write '%s'", env->files.output);
+        } else {
+            cmplt_save(env, benv->base, updated_doc);
+        }
+
+        filled = 1;
+    } fz_always(env->ctx) {
+        fz_drop_buffer(env->ctx, result);
+    } fz_catch(env->ctx) {
+        fprintf(stderr, "Failed record on line %d: %s\n", item->line_num, fz_caught_message(env->ctx));
+
+        cmplt_drop_doc(env);
+    }
+
+    env->files.output = NULL;
+    json_decref(record);
+
+    return filled;
+}
+
+
+void batch_fill_all(pdf_env *env) {
+    batch_env benv = {0};
+    work_pool *pool = NULL;
+    char *line = NULL;
+    size_t line_cap = 0;
+    char *default_pattern = NULL;
+    int line_num = 0, record_num = 0, filled = 0;
+    FILE *records;
+
+    if(strcmp(env->fill.batchFile, "-") == 0)
+        records = stdin;
+    else
+        records = fopen(env->fill.batchFile, "r");
+
+    if(records == NULL) {
+        fprintf(stderr, "Unable to open batch file '%s'\n", env->fill.batchFile);
+        return;
+    }
+
+    if(env->fill.planFile)
+        benv.plan = plan_load(env->fill.planFile);
+    else if(!env->fill.direct)
+        benv.template = cmplt_load_template(env->fill.tplFile);
+
+    if(benv.template == NULL && benv.plan == NULL && !env->fill.direct)
+        goto records_exit;
+
+    benv.pattern = env->files.output;
+
+    if(benv.pattern == NULL)
+        benv.pattern = default_pattern = batch_default_pattern(env->files.input);
+
+    fz_try(env->ctx) {
+        benv.base = cmplt_read_input(env->ctx, env->files.input);
+
+        if(benv.plan)
+            plan_check_pdf(env->ctx, benv.plan, env->files.input, benv.base);
+    } fz_catch(env->ctx) {
+        fprintf(stderr, "cannot read document: %s\n", fz_caught_message(env->ctx));
+        goto tpl_exit;
+    }
+
+    if(env->fill.jobs > 1) {
+        pool = work_new_pool(env, env->fill.jobs, batch_fill_record, &benv);
+    }
+
+    while(getline(&line, &line_cap, records) != -1) {
+        line_num++;
+
+        if(strspn(line, " \t\r\n") == strlen(line))
+            continue;
+
+        record_num++;
+
+        work_item *item = malloc(sizeof(work_item));
+        item->line = line;
+        item->line_num = line_num;
+        item->record_num = record_num;
+
+        if(pool) {
+            // the worker frees the line
+            work_pool_push(pool, item);
+            line = NULL;
+            line_cap = 0;
+        } else {
+            filled += batch_fill_record(env, &benv, item);
+            free(item);
+        }
+    }
+
+    if(pool) {
+        filled = work_pool_finish(pool);
+    }
+
+    fprintf(stderr, "Filled %d of %d records\n", filled, record_num);
+
+    snap_drop(env->ctx, env->snapshot);
+    env->snapshot = NULL;
+
+    free(line);
+    mm_drop_buffer(env->ctx, benv.base);
+
+tpl_exit:
+    free(default_pattern);
+    json_decref(benv.template);
+    plan_drop(benv.plan);
+
+records_exit:
+    if(records != stdin)
+        fclose(records);
+}
@@ -0,0 +1,206 @@
+#include <mupdf/fitz.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "fill.h"
+
+// fillpdf_bench, built with -DBUILD_BENCH=ON. times the image fingerprint both ways, XXH64 and the former MD5,
+// over the pages of the pdfs and the images given:
+//
+//   fillpdf_bench example/fw9.pdf example/fw8ben.pdf logo.png
+//
+// pdf pages are rendered at 144 dpi, the size of the images a fill usually adds. then the alpha split and opaque
+// check are timed against plain loops on opaque RGBA and GA pixmaps of 1 to 50 megapixels, the opaque check
+// reading every row as it must before an SMask is dropped. each timing runs for at least BENCH_SECONDS.
+
+#define BENCH_SECONDS 0.5
+
+// seconds per run of call, repeated for at least BENCH_SECONDS
+#define BENCH_TIME(secs, call) do { \
+        double bench_start = bench_now(); \
+        int bench_runs = 0; \
+        do { \
+            call; \
+            bench_runs++; \
+        } while(bench_now() - bench_start < BENCH_SECONDS); \
+        secs = (bench_now() - bench_start) / bench_runs; \
+    } while(0)
+
+typedef uint64_t (*bench_hash_func)(fz_context *ctx, fz_pixmap *pixmap);
+
+
+static double bench_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static double bench_hash(fz_context *ctx, fz_pixmap *pixmap, bench_hash_func func, uint64_t *hash) {
+    double bytes = (double) pixmap->w * pixmap->h * pixmap->n;
+    double start = bench_now(), elapsed;
+    int runs = 0;
+
+    do {
+        *hash = func(ctx, pixmap);
+        runs++;
+        elapsed = bench_now() - start;
+    } while(elapsed < BENCH_SECONDS);
+
+    return bytes * runs / elapsed / 1e6;
+}
+
+
+static void bench_hash_pixmap(fz_context *ctx, const char *name, int page, fz_pixmap *pixmap) {
+    uint64_t xxh64, md5;
+    double xxh64_rate = bench_hash(ctx, pixmap, u_fz_hash_pixmap_xxh64, &xxh64);
+    double md5_rate = bench_hash(ctx, pixmap, u_fz_hash_pixmap_md5, &md5);
+    char label[BATCH_NAME_LEN];
+
+    if(page > 0)
+        snprintf(label, BATCH_NAME_LEN, "%s p%d", name, page);
+    else
+        snprintf(label, BATCH_NAME_LEN, "%s", name);
+
+    printf("%-32s %5dx%-5d n=%d  xxh64 %8.0f MB/s  md5 %8.0f MB/s  %5.1fx\n", label, pixmap->w, pixmap->h, pixmap->n,
+           xxh64_rate, md5_rate, xxh64_rate / md5_rate);
+}
+
+
+// a pdf has each page hashed, anything else is read as an image
+static int bench_hash_file(fz_context *ctx, const char *path) {
+    const char *ext = strrchr(path, '.');
+    fz_document *doc = NULL;
+    fz_image *image = NULL;
+    fz_pixmap *pixmap = NULL;
+    int ok = 1;
+
+    fz_var(doc);
+    fz_var(image);
+    fz_var(pixmap);
+    fz_try(ctx) {
+        if(ext && strcasecmp(ext, ".pdf") == 0) {
+            fz_matrix ctm;
+
+            fz_scale(&ctm, 2, 2);
+            doc = fz_open_document(ctx, path);
+
+            for(int i = 0; i < fz_count_pages(ctx, doc); i++) {
+                pixmap = fz_new_pixmap_from_page_number(ctx, doc, i, &ctm, fz_device_rgb(ctx), 0);
+                bench_hash_pixmap(ctx, path, i + 1, pixmap);
+                fz_drop_pixmap(ctx, pixmap);
+                pixmap = NULL;
+            }
+        } else {
+            image = fz_new_image_from_file(ctx, path);
+            pixmap = fz_get_pixmap_from_image(ctx, image, NULL, NULL, NULL, NULL);
+            bench_hash_pixmap(ctx, path, 0, pixmap);
+        }
+    } fz_always(ctx) {
+        fz_drop_pixmap(ctx, pixmap);
+        fz_drop_image(ctx, image);
+        fz_drop_document(ctx, doc);
+    } fz_catch(ctx) {
+        fprintf(stderr, "cannot hash %s: %s\n", path, fz_caught_message(ctx));
+        ok = 0;
+    }
+
+    return ok;
+}
+
+
+// what img_split_alpha and img_alpha_opaque do, a sample at a time
+static void bench_split_plain(const unsigned char *src, int stride, int w, int h, int n, unsigned char *color, unsigned char *alpha) {
+    for(int y = 0; y < h; y++) {
+        const unsigned char *s = src + (size_t) y * stride;
+
+        for(int x = 0; x < w; x++) {
+            for(int i = 0; i < n - 1; i++)
+                *color++ = *s++;
+
+            *alpha++ = *s++;
+        }
+    }
+}
+
+
+static int bench_opaque_plain(const unsigned char *src, int stride, int w, int h, int n) {
+    for(int y = 0; y < h; y++) {
+        for(int x = 0; x < w; x++) {
+            if(src[(size_t) y * stride + x * n + n - 1] != 0xff)
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+static int bench_split_size(int megapixels, int n) {
+    int w = 2000, h = megapixels * 500;
+    size_t pixels = (size_t) w * h;
+    unsigned char *src = malloc(pixels * n);
+    unsigned char *color = malloc(pixels * (n - 1));
+    unsigned char *alpha = malloc(pixels);
+    volatile int opaque = 0;
+    double split, split_plain, check, check_plain;
+
+    if(src == NULL || color == NULL || alpha == NULL) {
+        fprintf(stderr, "cannot allocate a %d MP pixmap\n", megapixels);
+        free(src);
+        free(color);
+        free(alpha);
+        return 0;
+    }
+
+    for(size_t i = 0; i < pixels * n; i++)
+        src[i] = (i % n == n - 1) ? 0xff : (unsigned char) (i * 7);
+
+    BENCH_TIME(split, img_split_alpha(src, w * n, w, h, n, color, alpha));
+    BENCH_TIME(split_plain, bench_split_plain(src, w * n, w, h, n, color, alpha));
+    BENCH_TIME(check, opaque += img_alpha_opaque(src, w * n, w, h, n));
+    BENCH_TIME(check_plain, opaque += bench_opaque_plain(src, w * n, w, h, n));
+
+    printf("%3d MP n=%d  split %8.2f ms  plain %8.2f ms  %5.1fx   opaque %8.2f ms  plain %8.2f ms  %5.1fx\n",
+           megapixels, n, split * 1e3, split_plain * 1e3, split_plain / split, check * 1e3, check_plain * 1e3, check_plain / check);
+
+    free(src);
+    free(color);
+    free(alpha);
+    return 1;
+}
+
+
+int main(int argc, char **argv) {
+    const int sizes[] = { 1, 5, 10, 25, 50 };
+    int retval = EXIT_SUCCESS;
+
+    fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+
+    if(ctx == NULL) {
+        fprintf(stderr, "cannot initialise mupdf context\n");
+        return EXIT_FAILURE;
+    }
+
+    fz_register_document_handlers(ctx);
+
+    printf("image fingerprint, XXH64 against MD5\n");
+
+    for(int i = 1; i < argc; i++) {
+        if(!bench_hash_file(ctx, argv[i]))
+            retval = EXIT_FAILURE;
+    }
+
+    printf("\nalpha split and opaque check, against plain loops\n");
+
+    for(int i = 0; i < (int) (sizeof(sizes) / sizeof(sizes[0])); i++) {
+        if(!bench_split_size(sizes[i], 4) || !bench_split_size(sizes[i], 2))
+            retval = EXIT_FAILURE;
+    }
+
+    fz_drop_context(ctx);
+    return retval;
+}
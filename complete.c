@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <mupdf/fitz.h>
 #include <mupdf/pdf.h>
 #include <jansson.h>
@@ -5,15 +6,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "fill.h"
-#include "zlib.h"
+
+static fz_buffer *cmplt_save_signed(pdf_env *env, fz_buffer *base);
+static fz_buffer *cmplt_save_linear(pdf_env *env);
 
 
 void cmplt_fill_all(pdf_env *env) {
     json_error_t json_err;
+    fz_buffer *base = NULL;
+    char out_name[BATCH_NAME_LEN];
 
     FILE *data_file;
 
+    if(strcmp(env->files.input, "-") == 0 && env->fill.dataFile == NULL) {
+        fprintf(stderr, "The data must be given with -d when the pdf is read from stdin\n");
+        return;
+    }
+
     if(env->fill.dataFile)
         data_file = fopen(env->fill.dataFile, "r");
     else
@@ -29,80 +42,285 @@ void cmplt_fill_all(pdf_env *env) {
         goto data_exit;
     }
 
-    env->fill.json_input_data = data_json;
+    json_t *template = NULL;
+    fill_plan *plan = NULL;
+
+    if(env->fill.planFile)
+        plan = plan_load(env->fill.planFile);
+    else if(!env->fill.direct)
+        template = cmplt_load_template(env->fill.tplFile);
+
+    if (template == NULL && plan == NULL && !env->fill.direct)
+        goto data_exit;
+
+    if(env->files.output == NULL) {
+        cmplt_default_output(env->files.input, out_name, BATCH_NAME_LEN);
+        env->files.output = out_name;
+    }
+
+    fz_var(base);
+    fz_try(env->ctx) {
+        int updated_doc;
+
+        base = cmplt_read_input(env->ctx, env->files.input);
+
+        if(plan)
+            plan_check_pdf(env->ctx, plan, env->files.input, base);
+
+        env->doc = cmplt_open_buffer(env->ctx, base);
+        env->page_count = pdf_count_pages(env->ctx, env->doc);
+
+        if(plan)
+            updated_doc = plan_fill_pages(env, plan, data_json);
+        else if(template)
+            updated_doc = cmplt_fill_pages(env, template, data_json);
+        else
+            updated_doc = fld_fill_fields(env, data_json);
+
+        cmplt_save(env, base, updated_doc);
+    } fz_always(env->ctx) {
+        mm_drop_buffer(env->ctx, base);
+    } fz_catch (env->ctx) {
+        fprintf(stderr, "cannot complete '%s': %s\n", env->files.input, fz_caught_message(env->ctx));
+
+        cmplt_drop_doc(env);
+    }
+
+    json_decref(template);
+    plan_drop(plan);
+
+data_exit:
+    json_decref(data_json);
+
+    if(env->fill.dataFile)
+        fclose(data_file);
+}
+
+
+// input.pdf is completed to input_complete.pdf and stdin to stdout
+void cmplt_default_output(const char *input, char *buf, int buflen) {
+    int len = strlen(input);
 
-    json_t *template = json_load_file(env->fill.tplFile, 0, &json_err);
+    if(strcmp(input, "-") == 0) {
+        snprintf(buf, buflen, "-");
+        return;
+    }
+
+    len = (len > 4 && strcmp(input + len - 4, ".pdf") == 0) ? len - 4 : len;
+    snprintf(buf, buflen, "%.*s_complete.pdf", len, input);
+}
+
+
+// map the pdf, '-' reads stdin into memory as does a file that can't be mapped. a file's xref sidecar is applied
+// here, see xrefcache.c. drop with mm_drop_buffer
+static fz_buffer *cmplt_read_file(fz_context *ctx, const char *src, int map) {
+    fz_buffer *buf = NULL;
+    fz_stream *stm = NULL;
+    char chunk[CP_BUFSIZE];
+    size_t numbytes;
+
+    if(strcmp(src, "-") != 0) {
+        if(!map || (buf = mm_map_file(ctx, src)) == NULL) {
+            fz_var(stm);
+            fz_try(ctx) {
+                stm = fz_open_file(ctx, src);
+                buf = fz_read_all(ctx, stm, 0);
+            } fz_always(ctx) {
+                fz_drop_stream(ctx, stm);
+            } fz_catch(ctx) {
+                fz_rethrow(ctx);
+            }
+        }
+
+        return xrc_apply(ctx, src, buf);
+    }
+
+    buf = fz_new_buffer(ctx, CP_BUFSIZE);
+
+    fz_try(ctx) {
+        while(0 < (numbytes = fread(chunk, 1, CP_BUFSIZE, stdin)))
+            fz_write_buffer(ctx, buf, chunk, numbytes);
+
+        if(ferror(stdin))
+            fz_throw(ctx, FZ_ERROR_GENERIC, "cannot read stdin");
+    } fz_catch(ctx) {
+        fz_drop_buffer(ctx, buf);
+        fz_rethrow(ctx);
+    }
+
+    return buf;
+}
+
+
+fz_buffer *cmplt_read_input(fz_context *ctx, const char *src) {
+    return cmplt_read_file(ctx, src, 1);
+}
+
+
+// the pdf of a form kept for the life of the process, read into memory rather than mapped. a mapping faults on
+// every later read once the file is truncated or rewritten in place, as copying a new version over it does
+fz_buffer *cmplt_read_resident(fz_context *ctx, const char *src) {
+    return cmplt_read_file(ctx, src, 0);
+}
+
+
+// drop env->doc along with the objects cached for it. a document from env->snapshot is rolled back instead
+void cmplt_drop_doc(pdf_env *env) {
+    fnt_drop_doc_fonts(env);
+    img_drop_index(env->ctx, env->doc_images);
+    env->doc_images = NULL;
+
+    if(env->snapshot && env->snapshot->doc && env->snapshot->doc == env->doc)
+        snap_restore(env->ctx, env->snapshot);
+    else
+        pdf_drop_document(env->ctx, env->doc);
+
+    env->doc = NULL;
+}
+
+
+pdf_document *cmplt_open_buffer(fz_context *ctx, fz_buffer *buf) {
+    pdf_document *doc = NULL;
+    fz_stream *stm = mm_open_buffer(ctx, buf);
+
+    fz_try(ctx) {
+        doc = pdf_open_document_with_stream(ctx, stm);
+    } fz_always(ctx) {
+        fz_drop_stream(ctx, stm);
+    } fz_catch(ctx) {
+        fz_rethrow(ctx);
+    }
+
+    return doc;
+}
+
+
+json_t *cmplt_load_template(const char *tpl_file) {
+    json_error_t json_err;
+    json_t *template = json_load_file(tpl_file, 0, &json_err);
 
     if (template == NULL) {
-        fprintf(stderr, "Unable to load template file '%s'", env->fill.tplFile);
-        goto tpl_exit;
+        fprintf(stderr, "Unable to load template file '%s'", tpl_file);
+        return NULL;
     }
 
     if(!json_is_object(template)) {
-        fprintf(stderr, "Invalid template file '%s'. json root must be an object.", env->fill.tplFile);
-        goto tpl_exit;
+        fprintf(stderr, "Invalid template file '%s'. json root must be an object.", tpl_file);
+        json_decref(template);
+        return NULL;
     }
 
-    fz_try(env->ctx) {
-        const char* obj_idx;
-        int page_idx, item_idx;
-        json_t *page_val, *item_val;
+    return template;
+}
 
-        int updated_doc = 0;
-        json_object_foreach(template, obj_idx, page_val) {
-            // filter pages in the tpl.json.
-            if(!str_is_all_digits(obj_idx) || !json_is_array(page_val))
-                continue;
 
-            sscanf(obj_idx, "%d", &page_idx);
-            env->page_num = page_idx;
+// fill every page listed in the template with values from data_json. returns the count of updates made to env->doc
+int cmplt_fill_pages(pdf_env *env, json_t *template, json_t *data_json) {
+    const char* obj_idx;
+    int page_idx, item_idx;
+    json_t *page_val;
 
-            env->page = pdf_load_page(env->ctx, env->doc, page_idx);
+    int updated_doc = 0;
 
-            int updated_pg = 0;
+    env->fill.json_input_data = data_json;
+    env->add_sig = 0;
 
-            json_array_foreach(page_val, item_idx, env->fill.json_map_item) {
-                updated_pg += cmplt_fill_field(env);
-            }
+    json_object_foreach(template, obj_idx, page_val) {
+        // filter pages in the tpl.json.
+        if(!str_is_all_digits(obj_idx) || !json_is_array(page_val))
+            continue;
 
-            updated_pg += cmplt_set_page_readonly(env->ctx, env->doc, env->page);
+        sscanf(obj_idx, "%d", &page_idx);
+        cmplt_load_page(env, page_idx);
 
-            if(updated_pg) {
-                pdf_update_page(env->ctx, env->page);
-            }
+        int updated_pg = 0;
+
+        json_array_foreach(page_val, item_idx, env->fill.json_map_item) {
+            updated_pg += cmplt_fill_field(env);
+        }
 
-            pdf_drop_page(env->ctx, env->page);
+        updated_pg += cmplt_flush_overlay(env);
+        updated_pg += cmplt_set_page_readonly(env->ctx, env->doc, env->page);
 
-            updated_doc += updated_pg;
+        // the page update draws the changed widgets' appearances
+        if(updated_pg && !env->fill.need_appearances) {
+            pdf_update_page(env->ctx, env->page);
         }
 
-        cmplt_fcopy(env->files.input, env->files.output);
+        cmplt_drop_page(env);
 
-        if(updated_doc) {
-            pdf_write_options opts = {0};
-            opts.do_incremental = 1;
-            opts.do_compress = 1;
+        updated_doc += updated_pg;
+    }
 
-            pdf_save_document(env->ctx, env->doc, env->files.output, &opts);
-        }
+    return updated_doc;
+}
 
-        pdf_drop_document(env->ctx, env->doc);
+
+// env->doc was opened from base. returns a new buffer holding base with the changes appended as an incremental
+// update, signed if the template asked for it. env->doc is dropped, or rolled back when it's a snapshot's.
+fz_buffer *cmplt_save_buffer(pdf_env *env, fz_buffer *base, int updated_doc) {
+    unsigned char *data;
+    size_t len = fz_buffer_storage(env->ctx, base, &data);
+    fz_buffer *result = NULL;
+    fz_output *out = NULL;
+
+    fz_var(result);
+    fz_var(out);
+    fz_try(env->ctx) {
+        if(env->doc_images)
+            img_finish(env->ctx, env->doc, env->doc_images);
+
+        // both rewrite env->doc while saving it, it can't be rolled back after
+        if(env->add_sig || env->fill.linearize)
+            snap_release(env->snapshot, env->doc);
 
         if(env->add_sig) {
-            cmplt_sign_and_save(env);
+            result = cmplt_save_signed(env, base);
+        } else if(env->fill.linearize) {
+            result = cmplt_save_linear(env);
+        } else if(env->fill.objstm == OSTM_FULL && ostm_can_write(env->ctx, env->doc)) {
+            result = fz_new_buffer(env->ctx, len + CP_BUFSIZE);
+            ostm_write(env->ctx, env->doc, result, 1);
+        } else if(env->fill.objstm == OSTM_INCREMENTAL && ostm_can_write(env->ctx, env->doc)) {
+            result = fz_new_buffer(env->ctx, len + CP_BUFSIZE);
+            fz_write_buffer(env->ctx, result, data, len);
+
+            if(updated_doc)
+                ostm_write(env->ctx, env->doc, result, 0);
+        } else {
+            result = fz_new_buffer(env->ctx, len + CP_BUFSIZE);
+            fz_write_buffer(env->ctx, result, data, len);
+
+            if(updated_doc) {
+                pdf_write_options opts = {0};
+                opts.do_incremental = 1;
+                opts.do_compress = 1;
+
+                out = fz_new_output_with_buffer(env->ctx, result);
+                pdf_write_document(env->ctx, env->doc, out, &opts);
+            }
         }
-    } fz_catch (env->ctx) {
-
+    } fz_always(env->ctx) {
+        fz_drop_output(env->ctx, out);
+        cmplt_drop_doc(env);
+    } fz_catch(env->ctx) {
+        fz_drop_buffer(env->ctx, result);
+        fz_rethrow(env->ctx);
     }
 
-tpl_exit:
-    json_decref(template);
+    return result;
+}
 
-data_exit:
-    json_decref(data_json);
 
-    if(env->fill.dataFile)
-        fclose(data_file);
+// save env->doc, opened from base, to env->files.output in one write. '-' writes to stdout
+void cmplt_save(pdf_env *env, fz_buffer *base, int updated_doc) {
+    fz_buffer *result = cmplt_save_buffer(env, base, updated_doc);
+    int written = cmplt_fwrite_buffer(env->ctx, result, env->files.output);
+
+    fz_drop_buffer(env->ctx, result);
+
+    if(!written)
+        fz_throw(env->ctx, FZ_ERROR_GENERIC, "cannot write '%s'", env->files.output);
 }
 
 
@@ -116,7 +334,16 @@ int cmplt_fill_field(pdf_env *env) {
     if(!json_is_string(datakey))
         return 0;
 
-    env->fill.input_key = json_string_value(datakey);
+    if(!cmplt_input_value(env, json_string_value(datakey)))
+        return 0;
+
+    return cmplt_apply_field(env, map_input_data(env));
+}
+
+
+// look up the input data for key. returns 0 when there's no usable value
+int cmplt_input_value(pdf_env *env, const char *key) {
+    env->fill.input_key = key;
     json_t *dataval = json_object_get(env->fill.json_input_data, env->fill.input_key);
 
     if(dataval == NULL)
@@ -140,17 +367,23 @@ int cmplt_fill_field(pdf_env *env) {
     if(env->fill.input_data == NULL)
         return 0;
 
+    return 1;
+}
+
+
+// fill the current page with env->fill.input_data according to the item already mapped into env->fill
+int cmplt_apply_field(pdf_env *env, fill_type type) {
     int updated = 0;
     pdf_widget *widget;
 
-    switch(map_input_data(env)) {
+    switch(type) {
         case FIELD_ID:
-            widget = cmplt_find_widget_id(env->ctx, env->page, env->fill.field_id);
+            widget = cmplt_find_widget_id(env, env->fill.field_id);
             updated = cmplt_set_widget_value(env, widget, env->fill.input_data);
             break;
 
         case FIELD_NAME:
-            widget = cmplt_find_widget_name(env->ctx, env->page, env->fill.field_name);
+            widget = cmplt_find_widget_name(env, env->fill.field_name);
             updated = cmplt_set_widget_value(env, widget, env->fill.input_data);
             break;
 
@@ -162,11 +395,23 @@ int cmplt_fill_field(pdf_env *env) {
             updated = cmplt_add_text(env);
             break;
 
-        case ADD_SIGNATURE:
-            // delay signing until all fields complete in cmplt_fill_all, then save, reload, sign, resave
-            env->add_sig = 1;
-            memcpy(&env->add_sig_data, &env->fill.sig, sizeof(signature_data));
+        case ADD_SIGNATURE: {
+            // the signature is added once every field is complete, see cmplt_save_signed
+            pdf_signer *signer = NULL;
+
+            fz_try(env->ctx) {
+                signer = sgn_get(env->ctx, env->fill.sig.file, env->fill.sig.password);
+            } fz_catch(env->ctx) {
+                fprintf(stderr, "cannot load certificate: %s\n", fz_caught_message(env->ctx));
+            }
+
+            if(signer) {
+                env->fill.sig.signer = signer;
+                env->add_sig = 1;
+                memcpy(&env->add_sig_data, &env->fill.sig, sizeof(signature_data));
+            }
             break;
+        }
 
         case ADD_IMAGE:
             updated = cmplt_add_image(env);
@@ -180,17 +425,23 @@ int cmplt_fill_field(pdf_env *env) {
 }
 
 
-int cmplt_fcopy(const char *src, const char *dest) {
-    FILE *in = fopen(src, "r");
+int cmplt_fwrite_buffer(fz_context *ctx, fz_buffer *buf, const char *dest) {
+    unsigned char *data;
+    size_t len = fz_buffer_storage(ctx, buf, &data);
+
+    if(strcmp(dest, "-") == 0) {
+        size_t written = fwrite(data, 1, len, stdout);
+        return fflush(stdout) == 0 && written == len;
+    }
+
     FILE *out = fopen(dest, "w");
-    char buf[CP_BUFSIZE];
-    int numbytes;
 
-    while(0 < (numbytes = fread(buf, 1, CP_BUFSIZE, in)))
-        fwrite(buf, 1, numbytes, out);
+    if(!out)
+        return 0;
+
+    size_t written = fwrite(data, 1, len, out);
 
-    fclose(in);
-    fclose(out);
+    return fclose(out) == 0 && written == len;
 }
 
 
@@ -201,15 +452,59 @@ void cmplt_set_field_readonly(fz_context *ctx, pdf_document *doc, pdf_obj *field
 }
 
 
-int cmplt_add_text(pdf_env *env) {
-    int i, buflen;
-    pdf_obj *contents;
+// the page's overlay buffer, sized for a handful of items
+static fz_buffer *cmplt_overlay_ops(pdf_env *env) {
+    if(env->overlay.ops == NULL)
+        env->overlay.ops = fz_new_buffer(env->ctx, 1024);
+
+    return env->overlay.ops;
+}
+
+
+// each font is added to the page's resources once however many text items use it
+static void cmplt_overlay_font(pdf_env *env, pdf_obj *resources, const char *name, const char *path) {
+    page_overlay *ov = &env->overlay;
+
+    for(int i = 0; i < ov->font_len; i++) {
+        if(strcmp(ov->fonts[i], name) == 0)
+            return;
+    }
+
+    u_pdf_add_font_res(env, resources, name, path);
+
+    if(ov->font_len == ov->font_cap) {
+        ov->font_cap = ov->font_cap ? ov->font_cap * 2 : INIT_CAP;
+        ov->fonts = realloc(ov->fonts, sizeof(char *) * ov->font_cap);
+    }
+
+    ov->fonts[ov->font_len++] = name;
+}
+
+
+// write the page's overlay items as one content stream. returns 1 if there were any
+int cmplt_flush_overlay(pdf_env *env) {
+    page_overlay *ov = &env->overlay;
+    int flushed = 0;
+
+    if(ov->ops && fz_buffer_storage(env->ctx, ov->ops, NULL) > 0) {
+        cmplt_append_content(env, ov->ops);
+        flushed = 1;
+    }
+
+    fz_drop_buffer(env->ctx, ov->ops);
+    ov->ops = NULL;
+    ov->font_len = 0;
+
+    return flushed;
+}
 
-    unsigned char *content_str;
+
+int cmplt_add_text(pdf_env *env) {
     pdf_obj *resources = pdf_dict_get(env->ctx, env->page->obj, PDF_NAME_Resources);
-    fz_buffer *buf  = NULL, *buf_compr = NULL;
+    fz_buffer *buf = cmplt_overlay_ops(env);
+    size_t mark = fz_buffer_storage(env->ctx, buf, NULL);
     float curr_top, line_height = env->fill.text.fontsize * 1.2;
-    const char *templ1 = " BT %g %g %g rg 1 0 0 1 %g %g Tm /%s %g Tf";
+    const char *templ1 = "BT %g %g %g rg 1 0 0 1 %g %g Tm /%s %g Tf ";
     const char *templ2 = "Tj 0 -%g TD\n";
     fz_rect pg_rect = {0, 0, 0, 0};
     pdf_bound_page(env->ctx, env->page, &pg_rect);
@@ -217,19 +512,7 @@ int cmplt_add_text(pdf_env *env) {
     float max_top = pg_rect.y1 - pg_rect.y0 - line_height;
 
     fz_try(env->ctx) {
-        u_pdf_add_font_res(env, resources, env->fill.text.font, env->fill.text.fontfile);
-
-        contents = pdf_dict_get(env->ctx, env->page->obj, PDF_NAME_Contents);
-
-        if (pdf_is_array(env->ctx, contents)) {   // take last if more than one contents object
-            i = pdf_array_len(env->ctx, contents) - 1;
-            contents = pdf_array_get(env->ctx, contents, i);
-        }
-
-        buf = pdf_load_stream(env->ctx, contents);
-
-        if (!buf)
-            fz_throw(env->ctx, FZ_ERROR_GENERIC, "PDF: not a stream");
+        cmplt_overlay_font(env, resources, env->fill.text.font, env->fill.text.fontfile);
 
         text_data *txt = &env->fill.text;
         curr_top = pg_rect.y1 - pg_rect.y0 - txt->pos.top - txt->fontsize;
@@ -242,25 +525,18 @@ int cmplt_add_text(pdf_env *env) {
         while((text_tok = strtok(NULL, "\n")) != NULL) {
             curr_top += line_height;
             if(curr_top > max_top) break;
-            if(c > 0) fz_buffer_printf(env->ctx, buf, "T* ", strlen("T* "));
+            if(c > 0) fz_write_buffer(env->ctx, buf, "T* ", strlen("T* "));
             fz_buffer_print_pdf_string(env->ctx, buf, text_tok);
             fz_write_buffer(env->ctx, buf, "Tj\n", strlen("Tj\n"));
             c++;
         }
 
         fz_write_buffer(env->ctx, buf, "ET\n", strlen("ET\n"));
-        fz_write_buffer_byte(env->ctx, buf, 0);
-
-        pdf_dict_put(env->ctx, contents, PDF_NAME_Filter, PDF_NAME_FlateDecode);
-        buflen = fz_buffer_storage(env->ctx, buf, &content_str);
-        buf_compr = u_pdf_deflatebuf(env->ctx, content_str, (size_t) buflen);
-        pdf_update_stream(env->ctx, env->doc, contents, buf_compr, 1);
-
     } fz_always(env->ctx) {
-        if (buf) fz_drop_buffer(env->ctx, buf);
-        if (buf_compr) fz_drop_buffer(env->ctx, buf);
         free(text_dup);
     } fz_catch(env->ctx) {
+        // drop this item's partial operators, the items before it are kept
+        fz_resize_buffer(env->ctx, buf, mark);
         return 0;
     }
     return 1;
@@ -270,14 +546,10 @@ int cmplt_add_text(pdf_env *env) {
 int cmplt_add_image(pdf_env *env) {
     // mostly https://github.com/rk700/PyMuPDF/blob/master/fitz/fitz_wrap.c
     char X[15], Y[15], W[15], H[15], size_str[15], xref_str[15], name[50];
-    const char *template = " q %s 0 0 %s %s %s cm /%s Do Q \n";
+    const char *template = "q %s 0 0 %s %s %s cm /%s Do Q\n";
     const char *name_templ = "Image%s-%s-%s-%s";
-    fz_buffer *res = NULL;
-    fz_buffer *nres = NULL;
-    pdf_obj *resources, *subres, *contents, *ref;
-    fz_image *img;
-    size_t c_len;
-    unsigned char *content_str;
+    pdf_obj *resources, *subres, *ref;
+    fz_image *src = NULL, *img = NULL;
     image_data *imgdata = &env->fill.img;
     struct fz_rect_s pgrect, rect = {imgdata->pos.left, imgdata->pos.top, imgdata->pos.width, imgdata->pos.height};
     pdf_bound_page(env->ctx, env->page, &pgrect);
@@ -285,27 +557,33 @@ int cmplt_add_image(pdf_env *env) {
     fz_matrix page_ctm;
     pdf_page_transform(env->ctx, env->page, NULL, &page_ctm);
 
+    fz_var(src);
+    fz_var(img);
     fz_try(env->ctx) {
-        contents = pdf_dict_get(env->ctx, env->page->obj, PDF_NAME_Contents);
         resources = pdf_dict_get(env->ctx, env->page->obj, PDF_NAME_Resources);
         subres = pdf_dict_get(env->ctx, resources, PDF_NAME_XObject);
         if (!subres) {  // has no XObject yet
             subres = pdf_new_dict(env->ctx, env->doc, 10);
             pdf_dict_put_drop(env->ctx, resources, PDF_NAME_XObject, subres);
         }
-        img = fz_new_image_from_file(env->ctx, imgdata->file_name);
-        ref = u_pdf_add_image(env->ctx, env->doc, img, 0);
+        src = fz_new_image_from_file(env->ctx, imgdata->file_name);
 
         // scale image width to requested height or keep image width
         if(rect.x1 == 0) {
-            rect.x1 = (imgdata->pos.height == 0) ? img->w : img->w * rect.y1 / img->h;
+            rect.x1 = (imgdata->pos.height == 0) ? src->w : src->w * rect.y1 / src->h;
         }
 
         // scale image height to requested width or keep image height
         if(rect.y1 == 0) {
-            rect.y1 = (imgdata->pos.width == 0) ? img->h : img->h * rect.x1 / img->w;
+            rect.y1 = (imgdata->pos.width == 0) ? src->h : src->h * rect.x1 / src->w;
         }
 
+        img = img_fit_dpi(env->ctx, src, rect.x1, rect.y1, imgdata->max_dpi > 0 ? imgdata->max_dpi : env->fill.max_dpi);
+
+        if(env->doc_images == NULL)
+            env->doc_images = img_new_index(env->ctx, env->doc);
+        ref = u_pdf_add_image(env->ctx, env->doc, env->doc_images, img, 0);
+
         fz_transform_point((fz_point *)(&rect), &page_ctm);
 
         snprintf(X, 15, "%g", (double) rect.x0);
@@ -317,27 +595,11 @@ int cmplt_add_image(pdf_env *env) {
         snprintf(xref_str, 15, "%i", (int) pdf_to_num(env->ctx, env->page->obj));
         snprintf(name, 50, name_templ, size_str, xref_str, X, Y);
         pdf_dict_puts(env->ctx, subres, name, ref);
-        // retrieve and update contents stream
-        if (pdf_is_array(env->ctx, contents)) {            // take last if more than one contents object
-            int i = pdf_array_len(env->ctx, contents) - 1;
-            contents = pdf_array_get(env->ctx, contents, i);
-        }
-
-        res = pdf_load_stream(env->ctx, contents);
-        if (!res)
-            fz_throw(env->ctx, FZ_ERROR_GENERIC, "bad PDF: Contents is no stream object");
-
-        fz_buffer_printf(env->ctx, res, template, W, H, X, Y, name);
-        fz_write_buffer_byte(env->ctx, res, 0);
-        pdf_dict_put(env->ctx, contents, PDF_NAME_Filter, PDF_NAME_FlateDecode);
-        c_len = fz_buffer_storage(env->ctx, res, &content_str);
-        nres = cmplt_deflatebuf(env->ctx, content_str, (size_t) c_len);
-        pdf_update_stream(env->ctx, env->doc, contents, nres, 1);
 
+        fz_buffer_printf(env->ctx, cmplt_overlay_ops(env), template, W, H, X, Y, name);
     } fz_always(env->ctx) {
         if (img) fz_drop_image(env->ctx, img);
-        if (res) fz_drop_buffer(env->ctx, res);
-        if (nres) fz_drop_buffer(env->ctx, nres);
+        if (src) fz_drop_image(env->ctx, src);
     } fz_catch(env->ctx) {
         return 0;
     }
@@ -346,29 +608,73 @@ int cmplt_add_image(pdf_env *env) {
 }
 
 
-fz_buffer *cmplt_deflatebuf(fz_context *ctx, unsigned char *p, size_t n) {
-    fz_buffer *buf;
-    unsigned long csize;
-    int t;
-    unsigned long longN = (unsigned long)n;
-    unsigned char *data;
-    size_t cap;
-
-    if (n != (size_t)longN)
-        fz_throw(ctx, FZ_ERROR_GENERIC, "Buffer to large to deflate");
-
-    cap = compressBound(longN);
-    data = fz_malloc(ctx, cap);
-    buf = fz_new_buffer_from_data(ctx, data, cap);
-    csize = (uLongf)cap;
-    t = compress(data, &csize, p, longN);
-    if (t != Z_OK)
-    {
+// add a content stream holding ops to the end of the page's /Contents. the page's own content is wrapped in
+// q/Q the first time, so whatever graphics state it leaves behind doesn't leak into the overlay. nothing
+// already in the pdf is decompressed or rewritten
+void cmplt_append_content(pdf_env *env, fz_buffer *ops) {
+    fz_context *ctx = env->ctx;
+    pdf_obj *page_obj = env->page->obj;
+    pdf_obj *contents = pdf_dict_get(ctx, page_obj, PDF_NAME_Contents);
+    pdf_obj *stm = NULL, *arr = NULL;
+    fz_buffer *buf = NULL, *raw = NULL;
+
+    fz_var(stm);
+    fz_var(arr);
+    fz_var(buf);
+    fz_var(raw);
+    fz_try(ctx) {
+        if(!pdf_is_array(ctx, contents)) {
+            arr = pdf_new_array(ctx, env->doc, 3);
+
+            if(contents)
+                pdf_array_push(ctx, arr, contents);
+
+            pdf_dict_put(ctx, page_obj, PDF_NAME_Contents, arr);
+            contents = arr;
+        }
+
+        // the stream keeps its buffer, so each stream gets a new one
+        if(!env->page_wrapped) {
+            buf = fz_new_buffer(ctx, 8);
+            fz_write_buffer(ctx, buf, "q\n", 2);
+
+            stm = pdf_add_object_drop(ctx, env->doc, pdf_new_dict(ctx, env->doc, 1));
+            pdf_update_stream(ctx, env->doc, stm, buf, 0);
+            pdf_array_insert(ctx, contents, stm, 0);
+
+            pdf_drop_obj(ctx, stm);
+            fz_drop_buffer(ctx, buf);
+            stm = NULL;
+            buf = NULL;
+        }
+
+        raw = fz_new_buffer(ctx, fz_buffer_storage(ctx, ops, NULL) + 8);
+
+        if(!env->page_wrapped)
+            fz_write_buffer(ctx, raw, "Q\n", 2);
+
+        fz_write_buffer(ctx, raw, "q\n", 2);
+        fz_append_buffer(ctx, raw, ops);
+        fz_write_buffer(ctx, raw, "Q\n", 2);
+
+        unsigned char *data;
+        size_t len = fz_buffer_storage(ctx, raw, &data);
+        buf = dfl_compress_buffer(ctx, data, len);
+
+        stm = pdf_add_object_drop(ctx, env->doc, pdf_new_dict(ctx, env->doc, 2));
+        pdf_dict_put(ctx, stm, PDF_NAME_Filter, PDF_NAME_FlateDecode);
+        pdf_update_stream(ctx, env->doc, stm, buf, 1);
+        pdf_array_push(ctx, contents, stm);
+
+        env->page_wrapped = 1;
+    } fz_always(ctx) {
+        pdf_drop_obj(ctx, stm);
+        pdf_drop_obj(ctx, arr);
         fz_drop_buffer(ctx, buf);
-        fz_throw(ctx, FZ_ERROR_GENERIC, "cannot deflate buffer");
+        fz_drop_buffer(ctx, raw);
+    } fz_catch(ctx) {
+        fz_rethrow(ctx);
     }
-    fz_resize_buffer(ctx, buf, csize);
-    return buf;
 }
 
 
@@ -407,9 +713,9 @@ int cmplt_add_signature(fz_context *ctx, pdf_document *doc, pdf_page *page, sign
         if(sig->gfx != NULL)
             pathlist = vg_parse_str(sig->gfx);
 
-        u_pdf_sign_signature(ctx, doc, widget, sig->file, sig->password, pathlist, sig->text);
+        u_pdf_sign_signature(ctx, doc, widget, sig->signer, sig->file, sig->password, pathlist, sig->text);
     } fz_catch(ctx) {
-
+        fprintf(stderr, "cannot sign document: %s\n", fz_caught_message(ctx));
     }
 
     return 1;
@@ -425,7 +731,7 @@ int cmplt_add_textfield(pdf_env *env) {
     pdf_annot *annot = (pdf_annot*) widget;
 
     pdf_set_annot_rect(env->ctx, annot, &rect);
-    pdf_field_set_value(env->ctx, env->doc, annot->obj, env->fill.input_data);
+    cmplt_field_set_value(env, annot->obj, env->fill.input_data);
     pdf_field_set_display(env->ctx, env->doc, annot->obj, 0);
 
     char fn_str[50];
@@ -438,44 +744,50 @@ int cmplt_add_textfield(pdf_env *env) {
         cmplt_set_field_readonly(env->ctx, env->doc, annot->obj);
     }
 
+    // the new widget isn't in the page's index yet
+    idx_drop(env->ctx, env->page_index);
+    env->page_index = NULL;
+
     return 1;
 }
 
 
-pdf_widget *cmplt_find_widget_id(fz_context *ctx, pdf_page *page, int field_id) {
-    pdf_annot *annot = page->annots;
+// the page's widget index is built on the first lookup and dropped with the page
+static widget_index *cmplt_page_index(pdf_env *env) {
+    if(env->page_index == NULL)
+        env->page_index = idx_new_page_index(env->ctx, env->page);
 
-    while(annot) {
-        if(pdf_annot_type(ctx, annot) != PDF_ANNOT_WIDGET)
-            continue;
+    return env->page_index;
+}
 
-        if(pdf_to_num(ctx, annot->obj) == field_id)
-            return (pdf_widget *) annot;
 
-        annot = annot->next;
-    }
-
-    return NULL;
+pdf_widget *cmplt_find_widget_id(pdf_env *env, int field_id) {
+    return idx_find_id(cmplt_page_index(env), field_id);
 }
 
 
-pdf_widget *cmplt_find_widget_name(fz_context *ctx, pdf_page *page, const char *field_name) {
-    pdf_annot *annot = page->annots;
+pdf_widget *cmplt_find_widget_name(pdf_env *env, const char *field_name) {
+    return idx_find_name(cmplt_page_index(env), field_name);
+}
 
-    while(annot) {
-        if(pdf_annot_type(ctx, annot) != PDF_ANNOT_WIDGET)
-            continue;
 
-        char *utf8_name = UTF8_FIELD_NAME(ctx, annot->obj);
-        int cmp = strcmp(utf8_name, field_name);
+void cmplt_load_page(pdf_env *env, int page_num) {
+    env->page_num = page_num;
+    env->page = pdf_load_page(env->ctx, env->doc, page_num);
+    env->page_index = NULL;
+    env->page_wrapped = 0;
+}
 
-        if(cmp == 0)
-            return (pdf_widget *) annot;
 
-        annot = annot->next;
-    }
+void cmplt_drop_page(pdf_env *env) {
+    fz_drop_buffer(env->ctx, env->overlay.ops);
+    free(env->overlay.fonts);
+    memset(&env->overlay, 0, sizeof(page_overlay));
 
-    return NULL;
+    idx_drop(env->ctx, env->page_index);
+    pdf_drop_page(env->ctx, env->page);
+    env->page_index = NULL;
+    env->page = NULL;
 }
 
 
@@ -485,11 +797,105 @@ int cmplt_set_widget_value(pdf_env *env, pdf_widget *widget, const char *data) {
     }
 
     pdf_obj *obj = ((pdf_annot*) widget)->obj;
-    pdf_field_set_value(env->ctx, env->doc, obj, data);
+    cmplt_field_set_value(env, obj, data);
     return 1;
 }
 
 
+// the field holding a widget's value, the nearest with a name as mupdf finds it
+static pdf_obj *cmplt_field_head(fz_context *ctx, pdf_obj *obj) {
+    for(int depth = 0; obj && depth < IDX_MAX_DEPTH; depth++) {
+        if(pdf_dict_get(ctx, obj, PDF_NAME_T))
+            return obj;
+
+        obj = pdf_dict_get(ctx, obj, PDF_NAME_Parent);
+    }
+
+    return NULL;
+}
+
+
+// the first of a button widget's appearance states that isn't Off
+static const char *cmplt_on_state(fz_context *ctx, pdf_obj *widget) {
+    pdf_obj *states = pdf_dict_getp(ctx, widget, "AP/N");
+    int len = pdf_dict_len(ctx, states);
+
+    for(int i = 0; i < len; i++) {
+        const char *name = pdf_to_name(ctx, pdf_dict_get_key(ctx, states, i));
+
+        if(strcmp(name, "Off") != 0)
+            return name;
+    }
+
+    return NULL;
+}
+
+
+// check box and radio button values are a state name, "1" for the widget's on state or "0" for Off. each of the
+// field's widgets shows the state when it has an appearance for it, otherwise Off
+static void cmplt_set_button_state(fz_context *ctx, pdf_document *doc, pdf_obj *widget, pdf_obj *head, const char *value) {
+    pdf_obj *kids = pdf_dict_get(ctx, head, PDF_NAME_Kids);
+    int len = kids ? pdf_array_len(ctx, kids) : 1;
+    const char *state = value;
+
+    if(strcmp(value, "0") == 0 || *value == '\0')
+        state = "Off";
+    else if(strcmp(value, "1") == 0)
+        state = cmplt_on_state(ctx, widget);
+
+    if(state == NULL && kids)
+        state = cmplt_on_state(ctx, pdf_array_get(ctx, kids, 0));
+
+    if(state == NULL)
+        state = "Off";
+
+    pdf_dict_put_drop(ctx, head, PDF_NAME_V, pdf_new_name(ctx, doc, state));
+
+    for(int i = 0; i < len; i++) {
+        pdf_obj *kid = kids ? pdf_array_get(ctx, kids, i) : head;
+        int has_state = pdf_dict_gets(ctx, pdf_dict_getp(ctx, kid, "AP/N"), state) != NULL;
+
+        pdf_dict_put_drop(ctx, kid, PDF_NAME_AS, pdf_new_name(ctx, doc, has_state ? state : "Off"));
+    }
+}
+
+
+// set a field's value. mupdf sets it and marks the widgets for pdf_update_page to draw, with --need-appearances
+// only /V and the buttons' /AS are set, and the AcroForm's /NeedAppearances asks the viewer to draw every field
+void cmplt_field_set_value(pdf_env *env, pdf_obj *field, const char *value) {
+    fz_context *ctx = env->ctx;
+
+    if(!env->fill.need_appearances) {
+        pdf_field_set_value(ctx, env->doc, field, value);
+        return;
+    }
+
+    pdf_obj *head = cmplt_field_head(ctx, field);
+    pdf_obj *acroform = pdf_dict_getp(ctx, pdf_trailer(ctx, env->doc), "Root/AcroForm");
+
+    if(head == NULL)
+        head = field;
+
+    switch(pdf_field_type(ctx, env->doc, field)) {
+        case PDF_WIDGET_TYPE_CHECKBOX:
+        case PDF_WIDGET_TYPE_RADIOBUTTON:
+            cmplt_set_button_state(ctx, env->doc, field, head, value);
+            break;
+
+        case PDF_WIDGET_TYPE_PUSHBUTTON:
+        case PDF_WIDGET_TYPE_SIGNATURE:
+            return;
+
+        default:
+            pdf_dict_put_drop(ctx, head, PDF_NAME_V, pdf_new_string(ctx, env->doc, value, strlen(value)));
+            break;
+    }
+
+    if(acroform && !pdf_to_bool(ctx, pdf_dict_gets(ctx, acroform, "NeedAppearances")))
+        pdf_dict_puts_drop(ctx, acroform, "NeedAppearances", pdf_new_bool(ctx, env->doc, 1));
+}
+
+
 int str_is_all_digits(const char *str) {
     while(*str)
         if(!isdigit(*str++))
@@ -524,63 +930,85 @@ int cmplt_set_page_readonly(fz_context *ctx, pdf_document *doc, pdf_page *page)
 }
 
 
-static int cmplt_sign_and_save(pdf_env *env) {
-    int retval = 1;
-    pdf_document *sig_doc;
-    pdf_page *sig_page;
-    fz_context *sig_ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+// a file to sign in. mupdf completes signatures on a saved file through its path, so a memfd's /proc path is
+// used and nothing touches the disk. throws where there's no memfd rather than writing the pdf to a temp file
+static int cmplt_scratch_file(fz_context *ctx, char *path, int len) {
+#ifdef MFD_CLOEXEC
+    int fd = memfd_create("fillpdf", MFD_CLOEXEC);
 
-    if (!sig_ctx) {
-        fprintf(stderr, "cannot create mupdf context\n");
-        retval = 0;
-        goto sig_exit;
-    }
+    if(fd < 0)
+        fz_throw(ctx, FZ_ERROR_GENERIC, "cannot create an in-memory file to save to: %s", strerror(errno));
 
-    /* Only handle pdf. */
-    fz_try(sig_ctx) {
-        fz_register_document_handler(sig_ctx, &pdf_document_handler);
-    } fz_catch(sig_ctx) {
-        fprintf(stderr, "cannot register document handlers: %s\n", fz_caught_message(sig_ctx));
-        retval = 0;
-    }
+    snprintf(path, len, "/proc/self/fd/%d", fd);
+    return fd;
+#else
+    fz_throw(ctx, FZ_ERROR_GENERIC, "saving through mupdf needs memfd_create, which this system doesn't have");
+    return -1;
+#endif
+}
 
-    if(!retval) goto sig_exit_ctxt;
 
-    /* Open the document. */
-    fz_var(retval);
-    fz_try(sig_ctx) {
-        sig_doc = pdf_open_document(sig_ctx, env->files.output);
-    } fz_catch(sig_ctx)	{
-        fprintf(stderr, "cannot open document: %s\n", fz_caught_message(sig_ctx));
-        retval = 0;
-    }
+// save env->doc with mupdf through a scratch file, which can be seeked and appended to. base is the file to
+// update incrementally, NULL for a new file
+static fz_buffer *cmplt_save_file(pdf_env *env, fz_buffer *base, pdf_write_options *opts) {
+    char path[BATCH_NAME_LEN];
+    fz_buffer *saved = NULL;
+    fz_stream *stm = NULL;
 
-    if(!retval) goto sig_exit_ctxt;
+    int fd = cmplt_scratch_file(env->ctx, path, BATCH_NAME_LEN);
+
+    fz_var(stm);
+    fz_try(env->ctx) {
+        if(base && !cmplt_fwrite_buffer(env->ctx, base, path))
+            fz_throw(env->ctx, FZ_ERROR_GENERIC, "cannot write the document to update");
 
-    fz_try(sig_ctx) {
-        sig_page = pdf_load_page(sig_ctx, sig_doc, env->fill.sig.page_num);
-    } fz_catch(sig_ctx) {
-        fprintf(stderr, "cannot get page: %s\n", fz_caught_message(sig_ctx));
-        retval = 0;
+        pdf_save_document(env->ctx, env->doc, path, opts);
+
+        stm = fz_open_file(env->ctx, path);
+        saved = fz_read_all(env->ctx, stm, 0);
+    } fz_always(env->ctx) {
+        fz_drop_stream(env->ctx, stm);
+        close(fd);
+    } fz_catch(env->ctx) {
+        fz_rethrow(env->ctx);
     }
 
-    if(!retval) goto sig_exit_doc;
+    return saved;
+}
+
+
+// add the signature to env->doc alongside the filled fields and save them as one incremental update. mupdf
+// writes the digest into the ByteRange placeholder in place once the file is saved, so the save goes through
+// a scratch file. returns a new buffer holding the signed pdf.
+static fz_buffer *cmplt_save_signed(pdf_env *env, fz_buffer *base) {
+    pdf_write_options opts = {0};
 
-    fz_try(sig_ctx) {
-        cmplt_add_signature(sig_ctx, sig_doc, sig_page, &env->add_sig_data);
-        pdf_update_page(env->ctx, sig_page);
-        pdf_write_options sig_opts = {0};
-        sig_opts.do_incremental = 1;
-        pdf_save_document(sig_ctx, sig_doc, env->files.output, &sig_opts);
-    } fz_catch(sig_ctx) {
+    cmplt_load_page(env, env->add_sig_data.page_num);
 
+    fz_try(env->ctx) {
+        cmplt_add_signature(env->ctx, env->doc, env->page, &env->add_sig_data);
+        pdf_update_page(env->ctx, env->page);
+    } fz_always(env->ctx) {
+        cmplt_drop_page(env);
+    } fz_catch(env->ctx) {
+        fz_rethrow(env->ctx);
     }
 
-sig_exit_doc:
-    pdf_drop_document(sig_ctx, sig_doc);
-sig_exit_ctxt:
-    fz_drop_context(sig_ctx);
+    opts.do_incremental = 1;
+    opts.do_compress = 1;
 
-sig_exit:
-    return retval;
+    return cmplt_save_file(env, base, &opts);
+}
+
+
+// a garbage collected, linearized rewrite. page 1's objects come first with the hint tables, so a viewer can
+// show it before the rest of the file arrives
+static fz_buffer *cmplt_save_linear(pdf_env *env) {
+    pdf_write_options opts = {0};
+
+    opts.do_linear = 1;
+    opts.do_garbage = 1;
+    opts.do_compress = 1;
+
+    return cmplt_save_file(env, NULL, &opts);
 }
@@ -0,0 +1,319 @@
+#include <mupdf/fitz.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#include "fill.h"
+
+// deflate for the streams fillpdf writes itself. level and strategy are set once for the process from the command line.
+// a large input is cut into DFL_BLOCK sized blocks deflated on parallel threads, each primed with the 32K before
+// it, and joined as pigz does into one zlib stream: every block but the last ends on a sync flush. smaller inputs
+// are compressed in one go, by libdeflate when built with it and the level and strategy are ones it has.
+//
+// nothing here takes a fz_context so it can run on the image threads, dfl_compress_buffer is the fz wrapper.
+//
+// it's called from the image threads and every batch or serve thread at once, so the helper threads are drawn
+// from one budget for the process, a core each but the caller's. a call finding none spare deflates in one go.
+
+#define DFL_BLOCK (128 * 1024)
+#define DFL_WINDOW (32 * 1024)
+
+static int dfl_level = Z_DEFAULT_COMPRESSION;
+static int dfl_strategy = Z_DEFAULT_STRATEGY;
+
+static pthread_once_t dfl_spare_once = PTHREAD_ONCE_INIT;
+static int dfl_spare = 0;
+
+
+// level is -1 for zlib's default or 0 to 9, returns 0 if out of range
+int dfl_set_level(int level) {
+    if(level < -1 || level > 9)
+        return 0;
+
+    dfl_level = level;
+    return 1;
+}
+
+
+// returns 0 for an unknown strategy name
+int dfl_set_strategy(const char *strategy) {
+    static const char *names[] = { "default", "filtered", "huffman", "rle", "fixed" };
+    static const int values[] = { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE, Z_FIXED };
+
+    for(int i = 0; i < (int) (sizeof(values) / sizeof(values[0])); i++) {
+        if(strcmp(names[i], strategy) == 0) {
+            dfl_strategy = values[i];
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static unsigned char *dfl_compress_zlib(const unsigned char *src, size_t len, size_t *out_len) {
+    z_stream zs;
+
+    memset(&zs, 0, sizeof(zs));
+    if(deflateInit2(&zs, dfl_level, Z_DEFLATED, 15, 8, dfl_strategy) != Z_OK)
+        return NULL;
+
+    size_t cap = deflateBound(&zs, len);
+    unsigned char *out = malloc(cap);
+
+    zs.next_in = (unsigned char *) src;
+    zs.avail_in = len;
+    zs.next_out = out;
+    zs.avail_out = cap;
+
+    if(out == NULL || deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        free(out);
+        out = NULL;
+    } else {
+        *out_len = zs.total_out;
+    }
+
+    deflateEnd(&zs);
+
+    return out;
+}
+
+
+// libdeflate has no strategies and not every version stores at level 0, those go to zlib
+static unsigned char *dfl_compress_one(const unsigned char *src, size_t len, size_t *out_len) {
+#ifdef HAVE_LIBDEFLATE
+    if(dfl_level == 0 || dfl_strategy != Z_DEFAULT_STRATEGY)
+        return dfl_compress_zlib(src, len, out_len);
+
+    struct libdeflate_compressor *c = libdeflate_alloc_compressor(dfl_level < 0 ? 6 : dfl_level);
+
+    if(c == NULL)
+        return dfl_compress_zlib(src, len, out_len);
+
+    size_t cap = libdeflate_zlib_compress_bound(c, len);
+    unsigned char *out = malloc(cap);
+
+    if(out)
+        *out_len = libdeflate_zlib_compress(c, src, len, out, cap);
+
+    libdeflate_free_compressor(c);
+
+    if(out && *out_len == 0) {
+        free(out);
+        out = NULL;
+    }
+
+    return out;
+#else
+    return dfl_compress_zlib(src, len, out_len);
+#endif
+}
+
+
+typedef struct {
+    const unsigned char *src;
+    size_t len;
+    int count;
+    int next;
+    unsigned char **out;
+    size_t *out_len;
+    uLong *adler;
+} dfl_job;
+
+
+// a raw deflate of block i, without header or trailer
+static int dfl_block(dfl_job *job, int i) {
+    const unsigned char *block = job->src + (size_t) i * DFL_BLOCK;
+    size_t len = (i == job->count - 1) ? job->len - (size_t) i * DFL_BLOCK : DFL_BLOCK;
+    z_stream zs;
+    int ok = 0;
+
+    memset(&zs, 0, sizeof(zs));
+    if(deflateInit2(&zs, dfl_level, Z_DEFLATED, -15, 8, dfl_strategy) != Z_OK)
+        return 0;
+
+    if(i > 0)
+        deflateSetDictionary(&zs, block - DFL_WINDOW, DFL_WINDOW);
+
+    size_t cap = deflateBound(&zs, len) + 16;
+    unsigned char *out = malloc(cap);
+
+    zs.next_in = (unsigned char *) block;
+    zs.avail_in = len;
+    zs.next_out = out;
+    zs.avail_out = cap;
+
+    if(out) {
+        int ret = deflate(&zs, i == job->count - 1 ? Z_FINISH : Z_SYNC_FLUSH);
+        ok = (i == job->count - 1) ? ret == Z_STREAM_END : (ret == Z_OK && zs.avail_in == 0);
+    }
+
+    deflateEnd(&zs);
+
+    if(!ok) {
+        free(out);
+        return 0;
+    }
+
+    job->out[i] = out;
+    job->out_len[i] = zs.total_out;
+    job->adler[i] = adler32(1, block, len);
+
+    return 1;
+}
+
+
+static void *dfl_worker(void *arg) {
+    dfl_job *job = arg;
+    int i;
+
+    while((i = __sync_fetch_and_add(&job->next, 1)) < job->count) {
+        if(!dfl_block(job, i))
+            job->out[i] = NULL;
+    }
+
+    return NULL;
+}
+
+
+static unsigned char *dfl_compress_blocks(const unsigned char *src, size_t len, size_t *out_len, int threads) {
+    dfl_job job = { src, len, (int) ((len + DFL_BLOCK - 1) / DFL_BLOCK), 0, NULL, NULL, NULL };
+    pthread_t *tids = malloc(sizeof(pthread_t) * threads);
+    unsigned char *out = NULL;
+    int started = 0;
+
+    job.out = calloc(job.count, sizeof(unsigned char *));
+    job.out_len = calloc(job.count, sizeof(size_t));
+    job.adler = calloc(job.count, sizeof(uLong));
+
+    if(tids == NULL || job.out == NULL || job.out_len == NULL || job.adler == NULL)
+        goto done;
+
+    if(threads > job.count)
+        threads = job.count;
+
+    // this thread takes blocks too
+    for(started = 0; started < threads - 1; started++) {
+        if(pthread_create(&tids[started], NULL, dfl_worker, &job) != 0)
+            break;
+    }
+
+    dfl_worker(&job);
+
+    for(int t = 0; t < started; t++)
+        pthread_join(tids[t], NULL);
+
+    size_t total = 2 + 4;
+    uLong adler = job.adler[0];
+
+    for(int i = 0; i < job.count; i++) {
+        if(job.out[i] == NULL)
+            goto done;
+
+        total += job.out_len[i];
+
+        if(i > 0)
+            adler = adler32_combine(adler, job.adler[i], (i == job.count - 1) ? len - (size_t) i * DFL_BLOCK : DFL_BLOCK);
+    }
+
+    out = malloc(total);
+    if(out == NULL)
+        goto done;
+
+    // the header's level bits are only a hint, see RFC 1950
+    unsigned char *p = out;
+    int level = dfl_level < 0 ? 6 : dfl_level;
+    *p++ = 0x78;
+    *p++ = level < 2 ? 0x01 : level < 6 ? 0x5e : level == 6 ? 0x9c : 0xda;
+
+    for(int i = 0; i < job.count; i++) {
+        memcpy(p, job.out[i], job.out_len[i]);
+        p += job.out_len[i];
+    }
+
+    *p++ = adler >> 24;
+    *p++ = adler >> 16;
+    *p++ = adler >> 8;
+    *p++ = adler;
+    *out_len = total;
+
+done:
+    for(int i = 0; job.out && i < job.count; i++)
+        free(job.out[i]);
+
+    free(job.out);
+    free(job.out_len);
+    free(job.adler);
+    free(tids);
+
+    return out;
+}
+
+
+static void dfl_init_spare() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    dfl_spare = cpus > 1 ? cpus - 1 : 0;
+}
+
+
+// take up to want helper threads from the budget, returns how many were taken
+static int dfl_reserve(int want) {
+    pthread_once(&dfl_spare_once, dfl_init_spare);
+
+    while(1) {
+        int spare = dfl_spare;
+        int take = spare < want ? spare : want;
+
+        if(take <= 0)
+            return 0;
+
+        if(__sync_bool_compare_and_swap(&dfl_spare, spare, spare - take))
+            return take;
+    }
+}
+
+
+// zlib stream of len bytes of src, malloc'd, or NULL on failure
+unsigned char *dfl_compress(const unsigned char *src, size_t len, size_t *out_len) {
+    if(len >= 2 * DFL_BLOCK) {
+        int helpers = dfl_reserve((int) ((len + DFL_BLOCK - 1) / DFL_BLOCK) - 1);
+
+        if(helpers > 0) {
+            unsigned char *out = dfl_compress_blocks(src, len, out_len, helpers + 1);
+            __sync_fetch_and_add(&dfl_spare, helpers);
+
+            // a block's allocation or deflateInit2 failed, deflate it in one go instead
+            if(out)
+                return out;
+        }
+    }
+
+    return dfl_compress_one(src, len, out_len);
+}
+
+
+fz_buffer *dfl_compress_buffer(fz_context *ctx, const unsigned char *src, size_t len) {
+    size_t out_len;
+    unsigned char *out = dfl_compress(src, len, &out_len);
+    fz_buffer *buf = NULL;
+
+    if(out == NULL)
+        fz_throw(ctx, FZ_ERROR_GENERIC, "cannot deflate buffer");
+
+    fz_try(ctx) {
+        buf = fz_new_buffer(ctx, out_len);
+        fz_write_buffer(ctx, buf, out, out_len);
+    } fz_always(ctx) {
+        free(out);
+    } fz_catch(ctx) {
+        fz_rethrow(ctx);
+    }
+
+    return buf;
+}
@@ -0,0 +1,264 @@
+#include <mupdf/fitz.h>
+#include <mupdf/pdf.h>
+#include <jansson.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "fill.h"
+
+// direct fill, without a template. the data keys are fully qualified field names ("topmostSubform[0].Page1[0].f1_1[0]"),
+// resolved through a trie built from one walk of /Root/AcroForm/Fields. values are set on the field dictionaries and
+// only the pages holding a filled widget are loaded, to generate appearances.
+
+
+static fld_node *fld_new_node(fz_context *ctx, char *name) {
+    fld_node *node = fz_malloc_struct(ctx, fld_node);
+    node->name = name;
+    return node;
+}
+
+
+static fld_node *fld_add_kid(fz_context *ctx, fld_node *parent, char *name) {
+    if(parent->kid_len == parent->kid_cap) {
+        int cap = parent->kid_cap ? parent->kid_cap * 2 : INIT_CAP;
+        parent->kids = fz_resize_array(ctx, parent->kids, cap, sizeof(fld_node *));
+        parent->kid_cap = cap;
+    }
+
+    fld_node *node = fld_new_node(ctx, name);
+    parent->kids[parent->kid_len++] = node;
+
+    return node;
+}
+
+
+// fields without a /T are widgets of their parent field, they don't add a level to the name
+static void fld_add_field(fz_context *ctx, fld_node *parent, pdf_obj *field, int depth) {
+    if(depth >= IDX_MAX_DEPTH)
+        return;
+
+    pdf_obj *t = pdf_dict_get(ctx, field, PDF_NAME_T);
+    pdf_obj *kids = pdf_dict_get(ctx, field, PDF_NAME_Kids);
+    fld_node *node = parent;
+
+    if(t) {
+        node = fld_add_kid(ctx, parent, pdf_to_utf8(ctx, t));
+        node->field = field;
+    }
+
+    int kid_count = pdf_array_len(ctx, kids);
+
+    for(int i = 0; i < kid_count; i++)
+        fld_add_field(ctx, node, pdf_array_get(ctx, kids, i), depth + 1);
+}
+
+
+static int fld_cmp_node(const void *a, const void *b) {
+    return strcmp((*(fld_node **) a)->name, (*(fld_node **) b)->name);
+}
+
+
+static void fld_sort(fld_node *node) {
+    qsort(node->kids, node->kid_len, sizeof(fld_node *), fld_cmp_node);
+
+    for(int i = 0; i < node->kid_len; i++)
+        fld_sort(node->kids[i]);
+}
+
+
+fld_node *fld_new_trie(fz_context *ctx, pdf_document *doc) {
+    fld_node *root = fld_new_node(ctx, NULL);
+
+    fz_try(ctx) {
+        pdf_obj *fields = pdf_dict_getp(ctx, pdf_trailer(ctx, doc), "Root/AcroForm/Fields");
+        int count = pdf_array_len(ctx, fields);
+
+        for(int i = 0; i < count; i++)
+            fld_add_field(ctx, root, pdf_array_get(ctx, fields, i), 0);
+
+        fld_sort(root);
+    } fz_catch(ctx) {
+        fld_drop_trie(ctx, root);
+        fz_rethrow(ctx);
+    }
+
+    return root;
+}
+
+
+// binary search the kids for the len bytes of seg
+static fld_node *fld_find_kid(fld_node *node, const char *seg, int len) {
+    int lo = 0, hi = node->kid_len - 1;
+
+    while(lo <= hi) {
+        int mid = (lo + hi) / 2;
+        const char *name = node->kids[mid]->name;
+        int cmp = strncmp(name, seg, len);
+
+        if(cmp == 0)
+            cmp = name[len] != 0;
+
+        if(cmp == 0)
+            return node->kids[mid];
+        else if(cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    return NULL;
+}
+
+
+// returns the terminal field with the fully qualified name, or NULL
+pdf_obj *fld_find(fld_node *root, const char *name) {
+    fld_node *node = root;
+
+    while(node) {
+        const char *dot = strchr(name, '.');
+        int len = dot ? dot - name : strlen(name);
+
+        node = fld_find_kid(node, name, len);
+
+        if(dot == NULL)
+            break;
+
+        name = dot + 1;
+    }
+
+    return (node && node->kid_len == 0) ? node->field : NULL;
+}
+
+
+void fld_drop_trie(fz_context *ctx, fld_node *node) {
+    if(node == NULL)
+        return;
+
+    for(int i = 0; i < node->kid_len; i++)
+        fld_drop_trie(ctx, node->kids[i]);
+
+    fz_free(ctx, node->kids);
+    fz_free(ctx, node->name);
+    fz_free(ctx, node);
+}
+
+
+// map annotation object numbers to page numbers from the pages' /Annots arrays, no page is loaded
+static int *fld_annot_pages(fz_context *ctx, pdf_document *doc, int page_count, int xref_len) {
+    int *annot_pages = fz_malloc_array(ctx, xref_len, sizeof(int));
+
+    for(int i = 0; i < xref_len; i++)
+        annot_pages[i] = -1;
+
+    fz_try(ctx) {
+        for(int p = 0; p < page_count; p++) {
+            pdf_obj *annots = pdf_dict_get(ctx, pdf_lookup_page_obj(ctx, doc, p), PDF_NAME_Annots);
+            int count = pdf_array_len(ctx, annots);
+
+            for(int i = 0; i < count; i++) {
+                int num = pdf_to_num(ctx, pdf_array_get(ctx, annots, i));
+
+                if(num > 0 && num < xref_len)
+                    annot_pages[num] = p;
+            }
+        }
+    } fz_catch(ctx) {
+        fz_free(ctx, annot_pages);
+        fz_rethrow(ctx);
+    }
+
+    return annot_pages;
+}
+
+
+static void fld_mark_widget(fz_context *ctx, pdf_obj *widget, int *annot_pages, int xref_len, char *dirty_pages) {
+    int num = pdf_to_num(ctx, widget);
+
+    if(num > 0 && num < xref_len && annot_pages[num] >= 0)
+        dirty_pages[annot_pages[num]] = 1;
+}
+
+
+// the field is its own widget, or its widgets are the kids without a /T
+static void fld_mark_pages(fz_context *ctx, pdf_obj *field, int *annot_pages, int xref_len, char *dirty_pages) {
+    pdf_obj *kids = pdf_dict_get(ctx, field, PDF_NAME_Kids);
+    int count = pdf_array_len(ctx, kids);
+
+    fld_mark_widget(ctx, field, annot_pages, xref_len, dirty_pages);
+
+    for(int i = 0; i < count; i++) {
+        pdf_obj *kid = pdf_array_get(ctx, kids, i);
+
+        if(!pdf_dict_get(ctx, kid, PDF_NAME_T))
+            fld_mark_widget(ctx, kid, annot_pages, xref_len, dirty_pages);
+    }
+}
+
+
+// fill env->doc from data_json keyed by field name. returns the count of updates made to env->doc
+int fld_fill_fields(pdf_env *env, json_t *data_json) {
+    fz_context *ctx = env->ctx;
+    fld_node *trie = NULL;
+    int *annot_pages = NULL;
+    char *dirty_pages = NULL;
+    const char *key;
+    json_t *val;
+    int updated_doc = 0;
+
+    env->fill.json_input_data = data_json;
+    env->add_sig = 0;
+
+    fz_var(trie);
+    fz_var(annot_pages);
+    fz_var(dirty_pages);
+    fz_try(ctx) {
+        int xref_len = pdf_xref_len(ctx, env->doc);
+        env->page_count = pdf_count_pages(ctx, env->doc);
+
+        trie = fld_new_trie(ctx, env->doc);
+        annot_pages = fld_annot_pages(ctx, env->doc, env->page_count, xref_len);
+        dirty_pages = fz_calloc(ctx, env->page_count + 1, 1);
+
+        json_object_foreach(data_json, key, val) {
+            if(!cmplt_input_value(env, key))
+                continue;
+
+            pdf_obj *field = fld_find(trie, key);
+
+            if(field == NULL) {
+                fprintf(stderr, "No field named '%s'\n", key);
+                continue;
+            }
+
+            cmplt_field_set_value(env, field, env->fill.input_data);
+            fld_mark_pages(ctx, field, annot_pages, xref_len, dirty_pages);
+            updated_doc++;
+        }
+
+        for(int p = 0; p < env->page_count; p++) {
+            if(!dirty_pages[p])
+                continue;
+
+            cmplt_load_page(env, p);
+
+            fz_try(ctx) {
+                cmplt_set_page_readonly(ctx, env->doc, env->page);
+
+                if(!env->fill.need_appearances)
+                    pdf_update_page(ctx, env->page);
+            } fz_always(ctx) {
+                cmplt_drop_page(env);
+            } fz_catch(ctx) {
+                fz_rethrow(ctx);
+            }
+        }
+    } fz_always(ctx) {
+        fld_drop_trie(ctx, trie);
+        fz_free(ctx, annot_pages);
+        fz_free(ctx, dirty_pages);
+    } fz_catch(ctx) {
+        fz_rethrow(ctx);
+    }
+
+    return updated_doc;
+}
@@ -4,8 +4,11 @@
 #include <mupdf/fitz.h>
 #include <mupdf/pdf.h>
 #include <jansson.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
 
-#define CMD_COUNT 5
+#define CMD_COUNT 9
 
 const char *command_names[CMD_COUNT];
 extern fz_document_handler pdf_document_handler;
@@ -18,6 +21,22 @@ extern fz_document_handler pdf_document_handler;
 #define DEFAULT_FONT_HEIGHT 9
 
 #define CP_BUFSIZE 32768
+#define BATCH_NAME_LEN 1024
+#define WORK_QUEUE_DEPTH 16
+#define WORK_MAX_JOBS 256
+#define SRV_MAX_FRAME (64 * 1024 * 1024)
+#define SRV_BACKLOG 64
+
+#define IDX_MAX_DEPTH 32
+
+#define OSTM_INCREMENTAL 1
+#define OSTM_FULL 2
+
+#define PLAN_MAGIC "FPLN"
+#define PLAN_VERSION 4
+#define PLAN_NO_STR 0xFFFFFFFF
+#define XRC_MAGIC "FXRF"
+#define XRC_VERSION 2
 #define DEFAULT_SIG_VISIBLITY 1
 #define MAX_ERRLEN 160
 
@@ -39,7 +58,7 @@ typedef enum {FILL_DATA_INVALID = 0, FIELD_ID, FIELD_NAME, ADD_TEXTFIELD, ADD_TE
 
 #define INIT_CAP 8
 
-typedef enum { ANNOTATE_FIELDS, JSON_LIST, JSON_MAP, FONT_LIST, COMPLETE_PDF} command;
+typedef enum { ANNOTATE_FIELDS, JSON_LIST, JSON_MAP, FONT_LIST, COMPLETE_PDF, ZYGOTE, SERVE, COMPILE_PLAN, XREF_CACHE} command;
 
 // vg = vector graphics. a simple wrapper of mupdf's internal vg drawing api
 
@@ -115,6 +134,119 @@ typedef struct _vg_fz_pathlist {
     vg_list *paths;
 } vg_fz_pathlist;
 
+// per-page widget lookup tables, see index.c
+
+typedef struct {
+    int num;
+    pdf_widget *widget;
+} idx_id_entry;
+
+typedef struct {
+    char *name;
+    uint32_t hash;
+    pdf_widget *widget;
+} idx_name_entry;
+
+typedef struct {
+    uint32_t mask;
+    idx_id_entry *ids;
+    idx_name_entry *names;
+} widget_index;
+
+
+// overlay items collected while a page is filled, written as one content stream at the end of the page
+
+typedef struct {
+    fz_buffer *ops;
+    const char **fonts;
+    int font_len;
+    int font_cap;
+} page_overlay;
+
+
+// a font embedded in the current document, see fontcache.c
+
+typedef struct {
+    char *path;
+    pdf_obj *ref;
+} doc_font;
+
+
+// streaming hash state, see hash.c
+
+typedef struct {
+    uint64_t v[4];
+    uint64_t seed;
+    uint64_t total_len;
+    unsigned char mem[32];
+    size_t mem_len;
+} hsh_state;
+
+
+// the images in the current document, see images.c. a state is 0 until computed, 1 when set, -1 when unavailable
+
+typedef struct {
+    int w;
+    int h;
+    int bpc;
+    int enc_state;
+    uint64_t enc_hash;
+    size_t enc_len;
+    int pix_state;
+    uint64_t pix_hash;
+} img_key;
+
+typedef struct {
+    int num;
+    img_key key;
+} img_entry;
+
+// a decoded image's samples being deflated on their own thread, until img_finish writes the stream
+typedef struct {
+    pthread_t thread;
+    int started;
+    int num;
+    fz_buffer *samples;
+    int w;
+    int h;
+    int n;
+    const unsigned char *src;
+    unsigned char *data;
+    size_t data_len;
+    int error;
+} img_job;
+
+typedef struct {
+    img_entry *entries;
+    int len;
+    int cap;
+    img_job **jobs;
+    int job_len;
+    int job_cap;
+} img_index;
+
+
+// a document kept open between fills and rolled back to how it was opened after each, see snapshot.c
+
+typedef struct {
+    pdf_document *doc;
+    int xref_len;
+    int xref_sections;
+    int repaired;
+} doc_snapshot;
+
+
+// the acroform field name trie, see fields.c
+
+typedef struct _fld_node {
+    char *name;
+    pdf_obj *field;
+    struct _fld_node **kids;
+    int kid_len;
+    int kid_cap;
+} fld_node;
+
+
 // these structures hold data from the json template file
 
 typedef struct {
@@ -136,12 +268,14 @@ typedef struct {
     const char *gfx;
     int visible;
     int page_num;
+    pdf_signer *signer;
 } signature_data;
 
 
 typedef struct {
     pos_data pos;
     const char *file_name;
+    float max_dpi;
 } image_data;
 
 
@@ -166,6 +300,16 @@ typedef struct {
     files_env files;
     char *dataFile;
     char *tplFile;
+    char *planFile;
+    char *batchFile;
+    char *socketFile;
+    int jobs;
+    int direct;
+    int objstm;
+    int linearize;
+    int need_appearances;
+    int check_snapshot;
+    float max_dpi;
 
     char *certFile;
     char *certPwd;
@@ -202,6 +346,15 @@ typedef struct {
   command cmd;
 
   pdf_page *page;
+  widget_index *page_index;
+  int page_wrapped;
+  page_overlay overlay;
+
+  doc_font *doc_fonts;
+  int doc_font_len;
+  int doc_font_cap;
+  img_index *doc_images;
+  doc_snapshot *snapshot;
   int page_num;
   int page_count;
 
@@ -218,6 +371,142 @@ typedef struct {
 } pdf_env;
 
 
+// compiled template plans, see plan.c. the file is a plan_header, the plan_pages, the plan_items then the strings
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t page_count;
+    uint32_t item_count;
+    uint32_t strings_len;
+    uint32_t reserved;
+    uint64_t pdf_size;
+    uint64_t pdf_hash;
+} plan_header;
+
+typedef struct {
+    int32_t page_num;
+    uint32_t first_item;
+    uint32_t item_count;
+} plan_page;
+
+// strings are offsets into the string table, PLAN_NO_STR for none
+typedef struct {
+    int32_t type;
+    int32_t obj_num;
+    uint32_t key;
+    pos_data pos;
+    float fontsize;
+    float max_dpi;
+    float color[4];
+    int32_t editable;
+    int32_t visible;
+    uint32_t font;
+    uint32_t fontfile;
+    uint32_t file;
+    uint32_t text;
+    uint32_t gfx;
+} plan_item;
+
+typedef struct {
+    void *map;
+    size_t size;
+    plan_header *header;
+    plan_page *pages;
+    plan_item *items;
+    const char *strings;
+} fill_plan;
+
+
+// xref sidecars, see xrefcache.c. the file is an xrc_header, a xrc_row for each object number then the trailer
+// dictionary as text
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t file_hash;
+    uint32_t row_count;
+    uint32_t trailer_len;
+    uint32_t repaired;
+} xrc_header;
+
+typedef struct {
+    int64_t field2; // offset or object stream number
+    int32_t field3; // generation or index in the object stream
+    int32_t type;   // 0 free, 1 at an offset, 2 in an object stream
+} xrc_row;
+
+
+// shared by the batch workers, read only once the workers start
+
+typedef struct {
+    fz_buffer *base;
+    json_t *template;
+    fill_plan *plan;
+    const char *pattern;
+} batch_env;
+
+
+// a resident form, used by the zygote and serve commands
+
+typedef struct {
+    char *name;
+    json_t *template;
+    fz_buffer *base;
+    pdf_document *doc;
+} fill_form;
+
+
+// the work-stealing pool used by batch mode to fill records on several threads
+
+typedef struct {
+    char *line;
+    int line_num;
+    int record_num;
+} work_item;
+
+typedef int (*work_func)(pdf_env *env, void *shared, work_item *item);
+
+typedef struct {
+    pthread_mutex_t lock;
+    int head;
+    int len;
+    int cap;
+    work_item **items;
+} work_deque;
+
+typedef struct _work_pool work_pool;
+
+typedef struct {
+    pthread_t thread;
+    pdf_env env;
+    work_pool *pool;
+    int worker_num;
+    int result;
+} work_thread_env;
+
+struct _work_pool {
+    int count;
+    int started;
+    work_deque *deques;
+    work_thread_env *threads;
+    int next_deque;
+
+    work_func func;
+    void *shared;
+
+    pthread_mutex_t wait_lock;
+    pthread_cond_t items_cond;
+    pthread_cond_t space_cond;
+    int queued;
+    int max_queued;
+    int closed;
+};
+
+
 // used by info parsers. one parser get widget info, the other font info, the other general pdf info.
 // the pdf page parsing method is the same for each so parsed different output funcs
 typedef void (*pre_visit_doc_func)(pdf_env *);
@@ -246,22 +535,150 @@ int main(int argc, char **argv);
 
 //complete.c
 int cmplt_fill_field(pdf_env *env);
+int cmplt_input_value(pdf_env *env, const char *key);
+int cmplt_apply_field(pdf_env *env, fill_type type);
 void cmplt_fill_all(pdf_env *env);
+json_t *cmplt_load_template(const char *tpl_file);
+int cmplt_fill_pages(pdf_env *env, json_t *template, json_t *data_json);
+void cmplt_default_output(const char *input, char *buf, int buflen);
+fz_buffer *cmplt_read_input(fz_context *ctx, const char *src);
+fz_buffer *cmplt_read_resident(fz_context *ctx, const char *src);
+pdf_document *cmplt_open_buffer(fz_context *ctx, fz_buffer *buf);
+void cmplt_drop_doc(pdf_env *env);
+fz_buffer *cmplt_save_buffer(pdf_env *env, fz_buffer *base, int updated_doc);
+void cmplt_save(pdf_env *env, fz_buffer *base, int updated_doc);
 int cmplt_da_str(const char *font, float size, float *color, char *buf);
 int cmplt_set_page_readonly(fz_context *ctx, pdf_document *doc, pdf_page *page);
 void cmplt_set_field_readonly(fz_context *ctx, pdf_document *doc, pdf_obj *field);
-int cmplt_fcopy(const char *src, const char *dest);
-static int cmplt_sign_and_save(pdf_env *env);
+int cmplt_fwrite_buffer(fz_context *ctx, fz_buffer *buf, const char *dest);
 
 int cmplt_add_image(pdf_env *env);
 int cmplt_add_signature(fz_context *ctx, pdf_document *doc, pdf_page *page, signature_data *sig);
 int cmplt_add_textfield(pdf_env *env);
 int cmplt_add_text(pdf_env *env);
 int cmplt_set_widget_value(pdf_env *env, pdf_widget *widget, const char *data);
-pdf_widget *cmplt_find_widget_name(fz_context *ctx, pdf_page *page, const char *field_name);
-pdf_widget *cmplt_find_widget_id(fz_context *ctx, pdf_page *page, int field_id);
+void cmplt_field_set_value(pdf_env *env, pdf_obj *field, const char *value);
+pdf_widget *cmplt_find_widget_name(pdf_env *env, const char *field_name);
+pdf_widget *cmplt_find_widget_id(pdf_env *env, int field_id);
+void cmplt_load_page(pdf_env *env, int page_num);
+void cmplt_drop_page(pdf_env *env);
 int str_is_all_digits(const char *str);
-fz_buffer *cmplt_deflatebuf(fz_context *ctx, unsigned char *p, size_t n);
+void cmplt_append_content(pdf_env *env, fz_buffer *ops);
+int cmplt_flush_overlay(pdf_env *env);
+
+
+//batch.c
+void batch_fill_all(pdf_env *env);
+int batch_output_name(const char *pattern, int record_num, json_t *record, char *buf, int buflen);
+int batch_fill_record(pdf_env *env, void *shared, work_item *item);
+
+
+//workers.c
+fz_locks_context *work_fz_locks_context();
+work_pool *work_new_pool(pdf_env *env, int count, work_func func, void *shared);
+void work_pool_push(work_pool *pool, work_item *item);
+int work_pool_finish(work_pool *pool);
+
+
+//index.c
+char *idx_field_name(fz_context *ctx, pdf_obj *field);
+widget_index *idx_new_page_index(fz_context *ctx, pdf_page *page);
+pdf_widget *idx_find_id(widget_index *index, int num);
+pdf_widget *idx_find_name(widget_index *index, const char *name);
+void idx_drop(fz_context *ctx, widget_index *index);
+
+
+//fields.c
+fld_node *fld_new_trie(fz_context *ctx, pdf_document *doc);
+pdf_obj *fld_find(fld_node *root, const char *name);
+void fld_drop_trie(fz_context *ctx, fld_node *node);
+int fld_fill_fields(pdf_env *env, json_t *data_json);
+
+
+//fontcache.c
+fz_font *fnt_get(fz_context *ctx, const char *path);
+pdf_obj *fnt_doc_font(pdf_env *env, const char *path);
+void fnt_drop_doc_fonts(pdf_env *env);
+void fnt_free_doc_fonts(pdf_env *env);
+void fnt_drop_all(fz_context *ctx);
+
+
+//hash.c
+void hsh_init(hsh_state *state, uint64_t seed);
+void hsh_update(hsh_state *state, const void *data, size_t len);
+uint64_t hsh_final(hsh_state *state);
+uint64_t hsh_bytes(const void *data, size_t len);
+
+
+//deflate.c
+int dfl_set_level(int level);
+int dfl_set_strategy(const char *strategy);
+unsigned char *dfl_compress(const unsigned char *src, size_t len, size_t *out_len);
+fz_buffer *dfl_compress_buffer(fz_context *ctx, const unsigned char *src, size_t len);
+
+
+//mmap.c
+fz_buffer *mm_map_file(fz_context *ctx, const char *path);
+fz_buffer *mm_map_file_tail(fz_context *ctx, const char *path, struct stat *st, const unsigned char *tail, size_t tail_len);
+int mm_is_mapped(fz_context *ctx, fz_buffer *buf);
+fz_stream *mm_open_buffer(fz_context *ctx, fz_buffer *buf);
+void mm_drop_buffer(fz_context *ctx, fz_buffer *buf);
+
+
+//snapshot.c
+pdf_document *snap_open(fz_context *ctx, doc_snapshot *snap, fz_buffer *base);
+void snap_restore(fz_context *ctx, doc_snapshot *snap);
+void snap_release(doc_snapshot *snap, pdf_document *doc);
+void snap_drop(fz_context *ctx, doc_snapshot *snap);
+
+
+//xrefcache.c
+int xrc_write(fz_context *ctx, const char *input);
+fz_buffer *xrc_apply(fz_context *ctx, const char *path, fz_buffer *base);
+
+
+//objstm.c
+int ostm_can_write(fz_context *ctx, pdf_document *doc);
+void ostm_write(fz_context *ctx, pdf_document *doc, fz_buffer *out, int full);
+
+
+//images.c
+img_index *img_new_index(fz_context *ctx, pdf_document *doc);
+pdf_obj *img_find(fz_context *ctx, pdf_document *doc, img_index *index, fz_image *image, img_key *key);
+void img_insert(fz_context *ctx, img_index *index, pdf_obj *ref, img_key *key);
+void img_deflate_stream(fz_context *ctx, pdf_document *doc, img_index *index, pdf_obj *ref, fz_buffer *samples, int w, int h, int n);
+void img_finish(fz_context *ctx, pdf_document *doc, img_index *index);
+void img_drop_index(fz_context *ctx, img_index *index);
+int img_alpha_opaque(const unsigned char *src, int stride, int w, int h, int n);
+void img_split_alpha(const unsigned char *src, int stride, int w, int h, int n, unsigned char *color, unsigned char *alpha);
+fz_image *img_downsample(fz_context *ctx, fz_image *image, int w, int h);
+fz_image *img_fit_dpi(fz_context *ctx, fz_image *image, float w, float h, float max_dpi);
+
+
+//signers.c
+pdf_signer *sgn_get(fz_context *ctx, const char *path, const char *password);
+void sgn_drop_all(fz_context *ctx);
+
+
+//plan.c
+int plan_compile(pdf_env *env, fz_buffer *base);
+fill_plan *plan_load(const char *file);
+void plan_drop(fill_plan *plan);
+int plan_fill_pages(pdf_env *env, fill_plan *plan, json_t *data_json);
+void plan_check_pdf(fz_context *ctx, fill_plan *plan, const char *input, fz_buffer *base);
+
+
+//forms.c
+int form_load(pdf_env *env, fill_form *form, const char *name, json_t *conf, int warm);
+void form_drop(pdf_env *env, fill_form *form);
+
+
+//zygote.c
+void zyg_run(pdf_env *env);
+
+
+//serve.c
+void srv_run(pdf_env *env);
 
 
 //map_input.c
@@ -297,14 +714,14 @@ void visit_doc_end_overlay(pdf_env *penv);
 
 //util.c
 
-pdf_obj *u_pdf_add_image(fz_context *ctx, pdf_document *doc, fz_image *image, int mask);
-pdf_obj *u_pdf_find_image_resource(fz_context *ctx, pdf_document *doc, fz_image *item, unsigned char digest[16]);
-void u_pdf_preload_image_resources(fz_context *ctx, pdf_document *doc);
-void u_fz_md5_image(fz_context *ctx, fz_image *image, unsigned char digest[16]);
-void u_pdf_sign_signature(fz_context *ctx, pdf_document *doc, pdf_widget *widget, const char *sigfile, const char *password, vg_pathlist *pathlist, const char *overlay_msg);
+pdf_obj *u_pdf_add_image(fz_context *ctx, pdf_document *doc, img_index *index, fz_image *image, int mask);
+uint64_t u_fz_hash_pixmap_xxh64(fz_context *ctx, fz_pixmap *pixmap);
+uint64_t u_fz_hash_pixmap_md5(fz_context *ctx, fz_pixmap *pixmap);
+uint64_t u_fz_hash_pixmap(fz_context *ctx, fz_pixmap *pixmap);
+uint64_t u_fz_hash_image(fz_context *ctx, fz_image *image);
+void u_pdf_sign_signature(fz_context *ctx, pdf_document *doc, pdf_widget *widget, pdf_signer *signer, const char *sigfile, const char *password, vg_pathlist *pathlist, const char *overlay_msg);
 void u_pdf_set_signature_appearance(fz_context *ctx, pdf_document *doc, pdf_annot *annot, vg_pathlist *pathlist, const char *msg_1);
 void u_pdf_add_font_res(pdf_env *env, pdf_obj *resources, const char *name, const char *path);
-fz_buffer *u_pdf_deflatebuf(fz_context *ctx, unsigned char *p, int n);
 
 
 //vg_path.c
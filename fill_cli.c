@@ -2,12 +2,25 @@
 #include <mupdf/pdf.h>
 #include <jansson.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <ctype.h>
 
 #include "fill.h"
 
 const char *command_names[CMD_COUNT] = {
-    "annot", "info", "template", "fonts", "complete"
+    "annot", "info", "template", "fonts", "complete", "zygote", "serve", "compile", "xref"
+};
+
+static struct option long_options[] = {
+    {"socket", required_argument, NULL, 'S'},
+    {"max-dpi", required_argument, NULL, 'R'},
+    {"deflate-level", required_argument, NULL, 'L'},
+    {"deflate-strategy", required_argument, NULL, 'G'},
+    {"objstm", required_argument, NULL, 'O'},
+    {"linearize", no_argument, NULL, 'Z'},
+    {"need-appearances", no_argument, NULL, 'N'},
+    {"check-snapshot", no_argument, NULL, 'C'},
+    {NULL, 0, NULL, 0}
 };
 
 void usage_message(int cmd) {
@@ -15,11 +28,11 @@ void usage_message(int cmd) {
     fprintf(stderr, "  fillpdf <command> [options] input.pdf [output]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Available commands:\n");
-    fprintf(stderr, "  annot info template fonts complete\n");
+    fprintf(stderr, "  annot info template fonts complete zygote serve compile xref\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Examples:\n");
 
-    if(cmd != COMPLETE_PDF) {
+    if(cmd != COMPLETE_PDF && cmd != ZYGOTE && cmd != SERVE && cmd != COMPILE_PLAN && cmd != XREF_CACHE) {
         fprintf(stderr, "  fillpdf annot input.pdf [output.pdf]\n");
         fprintf(stderr, "      [output.pdf] defaults to the input filename suffixed with '_annotated.pdf'.\n");
         fprintf(stderr, "\n");
@@ -32,12 +45,27 @@ void usage_message(int cmd) {
 
     if(cmd == COMPLETE_PDF || cmd == -1) {
         fprintf(stderr, "  fillpdf complete [-t tpl.json] [-s cert.pfx] [-p passwd] [-d data.json] input.pdf [output.pdf]\n");
+        fprintf(stderr, "  fillpdf complete -F [-d data.json] input.pdf [output.pdf]\n");
+        fprintf(stderr, "  fillpdf complete -b records.ndjson [-j jobs] [-t tpl.json] [-s cert.pfx] [-p passwd] input.pdf [pattern.pdf]\n");
         fprintf(stderr, "\n");
         fprintf(stderr, "Options for 'complete':\n");
         fprintf(stderr, "  -t tpl.json   The template maps input data to pdf fields.\n");
         fprintf(stderr, "  -d data.json  Input data in json file.\n");
         fprintf(stderr, "  -s cert.pfx   Certificate to sign pdf.\n");
         fprintf(stderr, "  -p password   Password for cert.pfx.\n");
+        fprintf(stderr, "  -b file       Batch mode. Fill one output per line of newline delimited json records, '-' for stdin.\n");
+        fprintf(stderr, "  -j jobs       Number of threads filling batch records. Defaults to 1.\n");
+        fprintf(stderr, "  -P plan.fplan Fill from a template compiled with the 'compile' command instead of -t.\n");
+        fprintf(stderr, "  -F            No template. The data keys are fully qualified pdf field names.\n");
+        fprintf(stderr, "  --max-dpi dpi Resample added images placed above dpi. An image's \"max_dpi\" overrides it.\n");
+        fprintf(stderr, "  --deflate-level n     Level 0-9 for the image and content streams fillpdf writes.\n");
+        fprintf(stderr, "  --deflate-strategy s  default, filtered, huffman, rle or fixed.\n");
+        fprintf(stderr, "  --objstm mode Save with object streams and an xref stream. 'incremental' appends to input.pdf,\n");
+        fprintf(stderr, "                'full' rewrites it. Signed and encrypted documents are saved as usual.\n");
+        fprintf(stderr, "  --linearize   Rewrite the output linearized for fast web view. Signed documents are saved as usual.\n");
+        fprintf(stderr, "  --need-appearances  Set only the fields' values and leave drawing them to the viewer.\n");
+        fprintf(stderr, "  --check-snapshot    Batch mode. Fill each record into a freshly opened pdf as well and fail\n");
+        fprintf(stderr, "                      the record if the output differs. Signed records aren't compared.\n");
         fprintf(stderr, "\n");
         fprintf(stderr, "Notes for 'complete':\n");
         fprintf(stderr, "  If -t option not given then a template file is expected\n");
@@ -46,7 +74,51 @@ void usage_message(int cmd) {
         fprintf(stderr, "  If -d option missing then stdin is used\n");
         fprintf(stderr, "  The -s & -d options may be defined in the template, on the command line or unused\n");
         fprintf(stderr, "\n");
-        fprintf(stderr, "  output.pdf defaults to an auto-generated filename based on the input filename.\n");
+        fprintf(stderr, "  output.pdf defaults to the input filename suffixed with '_complete.pdf'.\n");
+        fprintf(stderr, "  An input.pdf of '-' is read from stdin, then -d is required. An output.pdf of '-' is written to stdout.\n");
+        fprintf(stderr, "\n");
+        fprintf(stderr, "  In batch mode the output is a pattern: %%n is replaced by the record number,\n");
+        fprintf(stderr, "  %%{key} by the record's value for key. It defaults to 'input_%%n.pdf'.\n");
+        fprintf(stderr, "\n");
+    }
+
+    if(cmd == ZYGOTE || cmd == -1) {
+        fprintf(stderr, "  fillpdf zygote [-j children] [-s cert.pfx] [-p passwd] forms.json\n");
+        fprintf(stderr, "\n");
+        fprintf(stderr, "Notes for 'zygote':\n");
+        fprintf(stderr, "  forms.json maps form names to {\"pdf\": file, \"template\": file, \"sigfile\": file, \"password\": pwd}.\n");
+        fprintf(stderr, "  Each form is loaded once, then every stdin line {\"form\": name, \"output\": file, \"data\": {...}}\n");
+        fprintf(stderr, "  is filled by a forked child. A json status line is written to stdout as each child exits.\n");
+        fprintf(stderr, "\n");
+    }
+
+    if(cmd == COMPILE_PLAN || cmd == -1) {
+        fprintf(stderr, "  fillpdf compile -t tpl.json [-s cert.pfx] [-p passwd] input.pdf [plan.fplan]\n");
+        fprintf(stderr, "\n");
+        fprintf(stderr, "Notes for 'compile':\n");
+        fprintf(stderr, "  Checks every template item against input.pdf and writes the resolved items as a binary plan\n");
+        fprintf(stderr, "  for 'complete -P'. Nothing is written if an item is invalid or names a widget not in the pdf.\n");
+        fprintf(stderr, "  plan.fplan defaults to the input filename with a .fplan extension.\n");
+        fprintf(stderr, "\n");
+    }
+
+    if(cmd == XREF_CACHE || cmd == -1) {
+        fprintf(stderr, "  fillpdf xref input.pdf\n");
+        fprintf(stderr, "\n");
+        fprintf(stderr, "Notes for 'xref':\n");
+        fprintf(stderr, "  Writes input.fxref, the resolved object offsets and page objects of input.pdf, repaired if its\n");
+        fprintf(stderr, "  xref is broken. While input.pdf is unchanged every command opens it with the cached table.\n");
+        fprintf(stderr, "\n");
+    }
+
+    if(cmd == SERVE || cmd == -1) {
+        fprintf(stderr, "  fillpdf serve --socket path [-j threads] [-s cert.pfx] [-p passwd] [forms.json]\n");
+        fprintf(stderr, "\n");
+        fprintf(stderr, "Notes for 'serve':\n");
+        fprintf(stderr, "  Requests and replies on the unix socket are json frames, each prefixed by a 4 byte big endian length.\n");
+        fprintf(stderr, "  {\"op\": \"load\", \"form\": name, \"pdf\": file, \"template\": file} makes a form resident.\n");
+        fprintf(stderr, "  {\"op\": \"fill\", \"form\": name, \"data\": {...}} is answered with a json header frame\n");
+        fprintf(stderr, "  then a frame holding the filled pdf. forms.json preloads forms as for 'zygote'.\n");
         fprintf(stderr, "\n");
     }
 }
@@ -68,7 +140,7 @@ int read_completion_cmd_args(int argc, char **argv, pdf_env *env) {
     argc--;
     argv++;
 
-    while((arg = getopt(argc, argv, "t:d:s:p:")) != -1) {
+    while((arg = getopt_long(argc, argv, "t:d:s:p:b:j:P:F", long_options, NULL)) != -1) {
         switch(arg) {
         case 't':
             env->fill.tplFile = optarg;
@@ -85,11 +157,79 @@ int read_completion_cmd_args(int argc, char **argv, pdf_env *env) {
         case 'p':
             env->fill.certPwd = optarg;
             break;
+
+        case 'b':
+            env->fill.batchFile = optarg;
+            break;
+
+        case 'j':
+            env->fill.jobs = atoi(optarg);
+
+            if(!*optarg || !str_is_all_digits(optarg) || env->fill.jobs < 1 || env->fill.jobs > WORK_MAX_JOBS) {
+                fprintf(stderr, "Error: -j must be 1-%d\n\n", WORK_MAX_JOBS);
+                return 0;
+            }
+            break;
+
+        case 'S':
+            env->fill.socketFile = optarg;
+            break;
+
+        case 'P':
+            env->fill.planFile = optarg;
+            break;
+
+        case 'F':
+            env->fill.direct = 1;
+            break;
+
+        case 'R':
+            env->fill.max_dpi = atof(optarg);
+            break;
+
+        case 'L':
+            if(!*optarg || !str_is_all_digits(optarg) || !dfl_set_level(atoi(optarg))) {
+                fprintf(stderr, "Error: deflate level must be 0-9\n\n");
+                return 0;
+            }
+            break;
+
+        case 'Z':
+            env->fill.linearize = 1;
+            break;
+
+        case 'N':
+            env->fill.need_appearances = 1;
+            break;
+
+        case 'C':
+            env->fill.check_snapshot = 1;
+            break;
+
+        case 'O':
+            if(strcmp(optarg, "incremental") == 0) {
+                env->fill.objstm = OSTM_INCREMENTAL;
+            } else if(strcmp(optarg, "full") == 0) {
+                env->fill.objstm = OSTM_FULL;
+            } else {
+                fprintf(stderr, "Error: --objstm is 'incremental' or 'full'\n\n");
+                return 0;
+            }
+            break;
+
+        case 'G':
+            if(!dfl_set_strategy(optarg)) {
+                fprintf(stderr, "Error: '%s' is not a deflate strategy\n\n", optarg);
+                return 0;
+            }
+            break;
         }
     }
 
     if(optind < argc) {
         env->files.input = argv[optind];
+    } else if(env->cmd == SERVE) {
+        return 1;
     } else {
         fprintf(stderr, "Error: Input filename missing\n\n");
         return 0;
@@ -137,13 +277,13 @@ int read_args(int argc, char **argv, pdf_env *env) {
     if(env->cmd == -1) {
         fprintf(stderr, "Error: '%s' is not a recognised command.\n\n", argv[1]);
         return 0;
-    } else if (argc == 2) {
+    } else if (argc == 2 && env->cmd != SERVE) {
         fprintf(stderr, "Error: No input file given.\n\n");
         return 0;
     }
 
-    if(env->cmd == COMPLETE_PDF) {
-        return read_completion_cmd_args(argc, argv, env);;
+    if(env->cmd == COMPLETE_PDF || env->cmd == ZYGOTE || env->cmd == SERVE || env->cmd == COMPILE_PLAN) {
+        return read_completion_cmd_args(argc, argv, env);
     } else {
         return read_parse_cmd_args(argc, argv, env);
     }
@@ -153,6 +293,7 @@ int main(int argc, char **argv) {
     const char *command;
     int caught_err = 0;
     int retval = EXIT_SUCCESS;
+    fz_buffer *base = NULL;
 
     pdf_env *env = malloc(sizeof(pdf_env));
     memset(env, 0, sizeof(pdf_env));
@@ -163,7 +304,11 @@ int main(int argc, char **argv) {
         goto main_exit;
     }
 
-    env->ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+    /* Worker threads clone the context, which needs locking. */
+    if(env->fill.jobs > 1 && ((env->cmd == COMPLETE_PDF && env->fill.batchFile) || env->cmd == SERVE))
+        env->ctx = fz_new_context(NULL, work_fz_locks_context(), FZ_STORE_UNLIMITED);
+    else
+        env->ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
 
     if (!env->ctx) {
         fprintf(stderr, "cannot create mupdf context\n");
@@ -181,9 +326,39 @@ int main(int argc, char **argv) {
 
     if(retval == EXIT_FAILURE) goto main_exit_ctxt;
 
-    /* Open the document. */
+    if(env->cmd == ZYGOTE) {
+        zyg_run(env);
+        goto main_exit_ctxt;
+    }
+
+    if(env->cmd == SERVE) {
+        srv_run(env);
+        goto main_exit_ctxt;
+    }
+
+    /* Batch mode opens its own copy of the document for each record. */
+    if(env->cmd == COMPLETE_PDF && env->fill.batchFile) {
+        batch_fill_all(env);
+        goto main_exit_ctxt;
+    }
+
+    /* Complete reads the pdf into memory, it may come from stdin. */
+    if(env->cmd == COMPLETE_PDF) {
+        cmplt_fill_all(env);
+        goto main_exit_ctxt;
+    }
+
+    if(env->cmd == XREF_CACHE) {
+        if(!xrc_write(env->ctx, env->files.input))
+            retval = EXIT_FAILURE;
+        goto main_exit_ctxt;
+    }
+
+    /* Open the document, base is kept for compile to fingerprint. */
+    fz_var(base);
     fz_try(env->ctx) {
-        env->doc = pdf_open_document(env->ctx, env->files.input);
+        base = cmplt_read_input(env->ctx, env->files.input);
+        env->doc = cmplt_open_buffer(env->ctx, base);
     } fz_catch(env->ctx)	{
         fprintf(stderr, "cannot open document: %s\n", fz_caught_message(env->ctx));
         retval = EXIT_FAILURE;
@@ -202,8 +377,10 @@ int main(int argc, char **argv) {
 
     if(retval == EXIT_FAILURE) goto main_exit_ctxt;
 
-    if(env->cmd == COMPLETE_PDF) {
-        cmplt_fill_all(env);
+    if(env->cmd == COMPILE_PLAN) {
+        if(!plan_compile(env, base))
+            retval = EXIT_FAILURE;
+        pdf_drop_document(env->ctx, env->doc);
     } else {
         parse_fields_doc(env);
         pdf_drop_document(env->ctx, env->doc);
@@ -211,6 +388,10 @@ int main(int argc, char **argv) {
 
 
 main_exit_ctxt:
+    mm_drop_buffer(env->ctx, base);
+    fnt_free_doc_fonts(env);
+    sgn_drop_all(env->ctx);
+    fnt_drop_all(env->ctx);
     fz_drop_context(env->ctx);
 main_exit:
     return retval;
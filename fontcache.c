@@ -0,0 +1,147 @@
+#include <mupdf/fitz.h>
+#include <mupdf/pdf.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "fill.h"
+
+// fonts for added text. a loaded fz_font is kept for the life of the process, keyed by its base14 name or file
+// path, and shared by every thread. each document embeds a font once, its /Font object is kept in env->doc_fonts
+// until the document is dropped by cmplt_drop_doc.
+
+typedef struct {
+    char *path;
+    fz_font *font;
+} fnt_entry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    fnt_entry *entries;
+    int len;
+    int cap;
+} fnt_cache;
+
+static fnt_cache cache = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+
+
+static fz_font *fnt_find(const char *path) {
+    fz_font *font = NULL;
+
+    pthread_mutex_lock(&cache.lock);
+
+    for(int i = 0; i < cache.len && font == NULL; i++) {
+        if(strcmp(cache.entries[i].path, path) == 0)
+            font = cache.entries[i].font;
+    }
+
+    pthread_mutex_unlock(&cache.lock);
+
+    return font;
+}
+
+
+// returns the font for a base14 name or a font file, the cache keeps the reference
+fz_font *fnt_get(fz_context *ctx, const char *path) {
+    const char *data;
+    int size;
+
+    if(path == NULL)
+        fz_throw(ctx, FZ_ERROR_GENERIC, "no font file given");
+
+    fz_font *font = fnt_find(path);
+
+    if(font)
+        return font;
+
+    data = fz_lookup_base14_font(ctx, path, &size);
+    if (data) {
+        font = fz_new_font_from_memory(ctx, path, data, size, 0, 0);
+    } else {
+        font = fz_new_font_from_file(ctx, NULL, path, 0, 0);
+    }
+
+    pthread_mutex_lock(&cache.lock);
+
+    // another thread may have loaded it meanwhile, the first one in is kept
+    for(int i = 0; i < cache.len; i++) {
+        if(strcmp(cache.entries[i].path, path) == 0) {
+            fz_drop_font(ctx, font);
+            font = cache.entries[i].font;
+            goto found;
+        }
+    }
+
+    if(cache.len == cache.cap) {
+        cache.cap = cache.cap ? cache.cap * 2 : INIT_CAP;
+        cache.entries = realloc(cache.entries, sizeof(fnt_entry) * cache.cap);
+    }
+
+    cache.entries[cache.len].path = strdup(path);
+    cache.entries[cache.len].font = font;
+    cache.len++;
+
+found:
+    pthread_mutex_unlock(&cache.lock);
+
+    return font;
+}
+
+
+// returns env->doc's /Font object for the font, embedding it on first use. env keeps the reference
+pdf_obj *fnt_doc_font(pdf_env *env, const char *path) {
+    for(int i = 0; i < env->doc_font_len; i++) {
+        if(strcmp(env->doc_fonts[i].path, path) == 0)
+            return env->doc_fonts[i].ref;
+    }
+
+    pdf_obj *ref = pdf_add_simple_font(env->ctx, env->doc, fnt_get(env->ctx, path));
+
+    if(env->doc_font_len == env->doc_font_cap) {
+        env->doc_font_cap = env->doc_font_cap ? env->doc_font_cap * 2 : INIT_CAP;
+        env->doc_fonts = realloc(env->doc_fonts, sizeof(doc_font) * env->doc_font_cap);
+    }
+
+    env->doc_fonts[env->doc_font_len].path = strdup(path);
+    env->doc_fonts[env->doc_font_len].ref = ref;
+    env->doc_font_len++;
+
+    return ref;
+}
+
+
+void fnt_drop_doc_fonts(pdf_env *env) {
+    for(int i = 0; i < env->doc_font_len; i++) {
+        pdf_drop_obj(env->ctx, env->doc_fonts[i].ref);
+        free(env->doc_fonts[i].path);
+    }
+
+    env->doc_font_len = 0;
+}
+
+
+// called when env is torn down, fnt_drop_doc_fonts keeps the array for the next document
+void fnt_free_doc_fonts(pdf_env *env) {
+    fnt_drop_doc_fonts(env);
+
+    free(env->doc_fonts);
+    env->doc_fonts = NULL;
+    env->doc_font_cap = 0;
+}
+
+
+// called once the other threads have finished
+void fnt_drop_all(fz_context *ctx) {
+    pthread_mutex_lock(&cache.lock);
+
+    for(int i = 0; i < cache.len; i++) {
+        fz_drop_font(ctx, cache.entries[i].font);
+        free(cache.entries[i].path);
+    }
+
+    free(cache.entries);
+    cache.entries = NULL;
+    cache.len = cache.cap = 0;
+
+    pthread_mutex_unlock(&cache.lock);
+}
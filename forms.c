@@ -0,0 +1,82 @@
+#include <mupdf/fitz.h>
+#include <mupdf/pdf.h>
+#include <jansson.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "fill.h"
+
+// resident forms for the zygote and serve commands. a form is a pdf read into memory with its parsed template
+// and, optionally, its decoded certificate. conf is {"pdf": file, "template": file, "sigfile": file, "password": pwd}.
+// a warm form also has its document opened with every page loaded.
+
+
+int form_load(pdf_env *env, fill_form *form, const char *name, json_t *conf, int warm) {
+    json_t *json_pdf = json_object_get(conf, "pdf");
+    json_t *json_tpl = json_object_get(conf, "template");
+    json_t *json_sigfile = json_object_get(conf, "sigfile");
+    json_t *json_pwd = json_object_get(conf, "password");
+    const char *password = env->fill.certPwd;
+    const char *sigfile = NULL;
+    fz_stream *stm = NULL;
+
+    memset(form, 0, sizeof(fill_form));
+    form->name = strdup(name);
+
+    if(!json_is_string(json_pdf) || !json_is_string(json_tpl)) {
+        fprintf(stderr, "Form '%s' needs 'pdf' and 'template' file names\n", name);
+        return 0;
+    }
+
+    if((form->template = cmplt_load_template(json_string_value(json_tpl))) == NULL)
+        return 0;
+
+    if(env->fill.certFile) {
+        sigfile = env->fill.certFile;
+    } else if(json_is_string(json_sigfile)) {
+        sigfile = json_string_value(json_sigfile);
+    }
+
+    if(!password && json_is_string(json_pwd))
+        password = json_string_value(json_pwd);
+
+    fz_var(stm);
+    fz_try(env->ctx) {
+        form->base = cmplt_read_resident(env->ctx, json_string_value(json_pdf));
+
+        // only the zygote's children fill form->doc, serve's threads each open their own from form->base.
+        // open from memory so forked children don't share a file offset with each other, the copy is
+        // shared with them until written
+        if(warm) {
+            stm = mm_open_buffer(env->ctx, form->base);
+            form->doc = pdf_open_document_with_stream(env->ctx, stm);
+
+            // loading each page resolves the page tree, annotations and widgets into the object cache
+            int page_count = pdf_count_pages(env->ctx, form->doc);
+            for(int i = 0; i < page_count; i++) {
+                pdf_drop_page(env->ctx, pdf_load_page(env->ctx, form->doc, i));
+            }
+        }
+
+        // decode the certificate into the signer cache ahead of the first fill
+        if(sigfile && password) {
+            sgn_get(env->ctx, sigfile, password);
+        }
+    } fz_always(env->ctx) {
+        fz_drop_stream(env->ctx, stm);
+    } fz_catch(env->ctx) {
+        fprintf(stderr, "cannot load form '%s': %s\n", name, fz_caught_message(env->ctx));
+        return 0;
+    }
+
+    fprintf(stderr, "Loaded form '%s'\n", name);
+    return 1;
+}
+
+
+void form_drop(pdf_env *env, fill_form *form) {
+    if(form->doc) pdf_drop_document(env->ctx, form->doc);
+    if(form->base) mm_drop_buffer(env->ctx, form->base);
+    json_decref(form->template);
+    free(form->name);
+}
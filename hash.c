@@ -0,0 +1,147 @@
+#include <string.h>
+#include "fill.h"
+
+// the non-cryptographic 64 bit hash used for cache keys and image fingerprints. this is XXH64, it reads the
+// input 8 bytes at a time in four independent lanes, where FNV and MD5 go a byte or a block at a time.
+
+#define HSH_P1 11400714785074694791ull
+#define HSH_P2 14029467366897019727ull
+#define HSH_P3 1609587929392839161ull
+#define HSH_P4 9650029242287828579ull
+#define HSH_P5 2870177450012600261ull
+
+
+static inline uint64_t hsh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hsh_read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hsh_read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hsh_round(uint64_t acc, uint64_t input) {
+    acc += input * HSH_P2;
+    acc = hsh_rotl(acc, 31);
+    return acc * HSH_P1;
+}
+
+static inline uint64_t hsh_merge(uint64_t acc, uint64_t v) {
+    acc ^= hsh_round(0, v);
+    return acc * HSH_P1 + HSH_P4;
+}
+
+
+void hsh_init(hsh_state *state, uint64_t seed) {
+    memset(state, 0, sizeof(hsh_state));
+    state->v[0] = seed + HSH_P1 + HSH_P2;
+    state->v[1] = seed + HSH_P2;
+    state->v[2] = seed;
+    state->v[3] = seed - HSH_P1;
+    state->seed = seed;
+}
+
+
+static const unsigned char *hsh_stripes(uint64_t v[4], const unsigned char *p, const unsigned char *end) {
+    uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+
+    while(p + 32 <= end) {
+        v0 = hsh_round(v0, hsh_read64(p));
+        v1 = hsh_round(v1, hsh_read64(p + 8));
+        v2 = hsh_round(v2, hsh_read64(p + 16));
+        v3 = hsh_round(v3, hsh_read64(p + 24));
+        p += 32;
+    }
+
+    v[0] = v0; v[1] = v1; v[2] = v2; v[3] = v3;
+    return p;
+}
+
+
+void hsh_update(hsh_state *state, const void *data, size_t len) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+
+    state->total_len += len;
+
+    if(state->mem_len + len < 32) {
+        memcpy(state->mem + state->mem_len, p, len);
+        state->mem_len += len;
+        return;
+    }
+
+    if(state->mem_len) {
+        size_t fill = 32 - state->mem_len;
+        memcpy(state->mem + state->mem_len, p, fill);
+        hsh_stripes(state->v, state->mem, state->mem + 32);
+        p += fill;
+        state->mem_len = 0;
+    }
+
+    p = hsh_stripes(state->v, p, end);
+
+    memcpy(state->mem, p, end - p);
+    state->mem_len = end - p;
+}
+
+
+uint64_t hsh_final(hsh_state *state) {
+    const unsigned char *p = state->mem;
+    const unsigned char *end = p + state->mem_len;
+    uint64_t h;
+
+    if(state->total_len >= 32) {
+        uint64_t *v = state->v;
+        h = hsh_rotl(v[0], 1) + hsh_rotl(v[1], 7) + hsh_rotl(v[2], 12) + hsh_rotl(v[3], 18);
+        h = hsh_merge(h, v[0]);
+        h = hsh_merge(h, v[1]);
+        h = hsh_merge(h, v[2]);
+        h = hsh_merge(h, v[3]);
+    } else {
+        h = state->seed + HSH_P5;
+    }
+
+    h += state->total_len;
+
+    while(p + 8 <= end) {
+        h ^= hsh_round(0, hsh_read64(p));
+        h = hsh_rotl(h, 27) * HSH_P1 + HSH_P4;
+        p += 8;
+    }
+
+    if(p + 4 <= end) {
+        h ^= (uint64_t) hsh_read32(p) * HSH_P1;
+        h = hsh_rotl(h, 23) * HSH_P2 + HSH_P3;
+        p += 4;
+    }
+
+    while(p < end) {
+        h ^= (*p++) * HSH_P5;
+        h = hsh_rotl(h, 11) * HSH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= HSH_P2;
+    h ^= h >> 29;
+    h *= HSH_P3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+
+uint64_t hsh_bytes(const void *data, size_t len) {
+    hsh_state state;
+
+    hsh_init(&state, 0);
+    hsh_update(&state, data, len);
+
+    return hsh_final(&state);
+}
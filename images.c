@@ -0,0 +1,794 @@
+#include <mupdf/fitz.h>
+#include <mupdf/pdf.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "fill.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IMG_X86 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define IMG_NEON 1
+#endif
+
+// finds an image already in the document before another copy is added. the index is built from the image
+// dictionaries only, no stream is read. a candidate with the same dimensions is compared by a hash of its
+// encoded stream bytes and the dictionary entries that change how they're drawn, read when first needed, and
+// the bytes themselves when the hashes match. only if that can't decide are both decoded and their pixels
+// compared. images with a soft or colour key mask are never shared, the mask would have to match as well, save
+// those whose alpha this fill split off into an SMask: they're keyed by their samples with the alpha.
+//
+// images placed at more than their max_dpi are resampled down to it first, see img_fit_dpi. decoded samples are
+// deflated with PNG predictors on a thread of their own while the fill goes on, img_finish writes the streams.
+
+
+// objects are hashed as written, an indirect reference by its number
+static void img_hash_obj(fz_context *ctx, hsh_state *state, pdf_obj *obj, int depth) {
+    char tag;
+
+    if(obj == NULL || depth > 8) {
+        tag = 0;
+        hsh_update(state, &tag, 1);
+    } else if(pdf_is_indirect(ctx, obj)) {
+        int num = pdf_to_num(ctx, obj);
+        tag = 'R';
+        hsh_update(state, &tag, 1);
+        hsh_update(state, &num, sizeof(num));
+    } else if(pdf_is_name(ctx, obj)) {
+        const char *name = pdf_to_name(ctx, obj);
+        tag = '/';
+        hsh_update(state, &tag, 1);
+        hsh_update(state, name, strlen(name) + 1);
+    } else if(pdf_is_number(ctx, obj) || pdf_is_bool(ctx, obj)) {
+        float val = pdf_is_bool(ctx, obj) ? pdf_to_bool(ctx, obj) : pdf_to_real(ctx, obj);
+        tag = pdf_is_bool(ctx, obj) ? 'b' : 'r';
+        hsh_update(state, &tag, 1);
+        hsh_update(state, &val, sizeof(val));
+    } else if(pdf_is_string(ctx, obj)) {
+        int len = pdf_to_str_len(ctx, obj);
+        tag = 's';
+        hsh_update(state, &tag, 1);
+        hsh_update(state, &len, sizeof(len));
+        hsh_update(state, pdf_to_str_buf(ctx, obj), len);
+    } else if(pdf_is_array(ctx, obj)) {
+        int len = pdf_array_len(ctx, obj);
+        tag = '[';
+        hsh_update(state, &tag, 1);
+        hsh_update(state, &len, sizeof(len));
+        for(int i = 0; i < len; i++)
+            img_hash_obj(ctx, state, pdf_array_get(ctx, obj, i), depth + 1);
+    } else if(pdf_is_dict(ctx, obj)) {
+        int len = pdf_dict_len(ctx, obj);
+        tag = '<';
+        hsh_update(state, &tag, 1);
+        hsh_update(state, &len, sizeof(len));
+        for(int i = 0; i < len; i++) {
+            img_hash_obj(ctx, state, pdf_dict_get_key(ctx, obj, i), depth + 1);
+            img_hash_obj(ctx, state, pdf_dict_get_val(ctx, obj, i), depth + 1);
+        }
+    } else {
+        tag = 'n';
+        hsh_update(state, &tag, 1);
+    }
+}
+
+
+// the dictionary entries besides the filter that change how the stream bytes are drawn
+static void img_hash_attrs(fz_context *ctx, hsh_state *state, pdf_obj *colorspace, pdf_obj *decode, pdf_obj *parms, pdf_obj *image_mask) {
+    img_hash_obj(ctx, state, colorspace, 0);
+    img_hash_obj(ctx, state, decode, 0);
+    img_hash_obj(ctx, state, parms, 0);
+    img_hash_obj(ctx, state, image_mask, 0);
+}
+
+
+// the encoded key covers what the image dictionary would say as well as the stream bytes. attrs is the
+// state img_hash_attrs started
+static void img_set_enc(img_key *key, hsh_state *attrs, const char *filter, const unsigned char *data, size_t len) {
+    hsh_state state = *attrs;
+    int dims[3] = { key->w, key->h, key->bpc };
+
+    hsh_update(&state, filter, strlen(filter) + 1);
+    hsh_update(&state, dims, sizeof(dims));
+    hsh_update(&state, data, len);
+
+    key->enc_state = 1;
+    key->enc_hash = hsh_final(&state);
+    key->enc_len = len;
+}
+
+
+static const char *img_filter_name(int type) {
+    switch(type) {
+        case FZ_IMAGE_JPEG: return "DCTDecode";
+        case FZ_IMAGE_JPX: return "JPXDecode";
+        case FZ_IMAGE_FAX: return "CCITTFaxDecode";
+        case FZ_IMAGE_FLATE: return "FlateDecode";
+        case FZ_IMAGE_LZW: return "LZWDecode";
+        case FZ_IMAGE_RLD: return "RunLengthDecode";
+        case FZ_IMAGE_UNKNOWN: return "";
+        default: return NULL;
+    }
+}
+
+
+// the key of an image about to be added. only images u_pdf_add_image copies through compressed have an
+// encoded hash, the rest are re-encoded from their pixels. a masked image gets a key nothing matches
+static void img_new_key(fz_context *ctx, fz_image *image, img_key *key) {
+    fz_compressed_buffer *cbuffer = fz_compressed_image_buffer(ctx, image);
+
+    memset(key, 0, sizeof(img_key));
+    key->w = image->w;
+    key->h = image->h;
+    key->bpc = image->bpc;
+    key->enc_state = -1;
+
+    if(image->mask) {
+        key->pix_state = -1;
+        return;
+    }
+
+    if(cbuffer != NULL && cbuffer->params.type != FZ_IMAGE_PNG && cbuffer->params.type != FZ_IMAGE_TIFF) {
+        const char *filter = img_filter_name(cbuffer->params.type);
+        int n = fz_colorspace_n(ctx, image->colorspace);
+        pdf_obj *colorspace = NULL;
+        hsh_state attrs;
+        unsigned char *data;
+        size_t len = fz_buffer_storage(ctx, cbuffer->buffer, &data);
+
+        // the entries u_pdf_add_image writes, it never writes a /Decode or /DecodeParms
+        if(!image->colorspace || n == 1)
+            colorspace = PDF_NAME_DeviceGray;
+        else if(n == 3)
+            colorspace = PDF_NAME_DeviceRGB;
+        else if(n == 4)
+            colorspace = PDF_NAME_DeviceCMYK;
+
+        hsh_init(&attrs, 0);
+        img_hash_attrs(ctx, &attrs, colorspace, NULL, NULL, NULL);
+
+        if(filter)
+            img_set_enc(key, &attrs, filter, data, len);
+    }
+}
+
+
+static void img_entry_enc(fz_context *ctx, pdf_document *doc, img_entry *e) {
+    pdf_obj *obj = pdf_new_indirect(ctx, doc, e->num, 0);
+    fz_buffer *buf = NULL;
+
+    e->key.enc_state = -1;
+
+    fz_var(buf);
+    fz_try(ctx) {
+        pdf_obj *filter = pdf_dict_get(ctx, obj, PDF_NAME_Filter);
+        unsigned char *data;
+
+        if(pdf_is_array(ctx, filter) && pdf_array_len(ctx, filter) == 1)
+            filter = pdf_array_get(ctx, filter, 0);
+
+        if(filter == NULL || pdf_is_name(ctx, filter)) {
+            pdf_obj *parms = pdf_dict_get(ctx, obj, PDF_NAME_DecodeParms);
+            hsh_state attrs;
+
+            if(pdf_is_array(ctx, parms) && pdf_array_len(ctx, parms) == 1)
+                parms = pdf_array_get(ctx, parms, 0);
+
+            hsh_init(&attrs, 0);
+            img_hash_attrs(ctx, &attrs, pdf_dict_get(ctx, obj, PDF_NAME_ColorSpace), pdf_dict_get(ctx, obj, PDF_NAME_Decode),
+                           parms, pdf_dict_get(ctx, obj, PDF_NAME_ImageMask));
+
+            buf = pdf_load_raw_stream(ctx, doc, e->num, 0);
+            size_t len = fz_buffer_storage(ctx, buf, &data);
+            img_set_enc(&e->key, &attrs, filter ? pdf_to_name(ctx, filter) : "", data, len);
+        }
+    } fz_always(ctx) {
+        fz_drop_buffer(ctx, buf);
+        pdf_drop_obj(ctx, obj);
+    } fz_catch(ctx) {
+        e->key.enc_state = -1;
+    }
+}
+
+
+// the hashes matched, check the stream bytes do
+static int img_same_bytes(fz_context *ctx, pdf_document *doc, img_entry *e, fz_image *image) {
+    fz_compressed_buffer *cbuffer = fz_compressed_image_buffer(ctx, image);
+    fz_buffer *buf = NULL;
+    int same = 0;
+
+    fz_var(buf);
+    fz_try(ctx) {
+        unsigned char *data, *other;
+        size_t len = fz_buffer_storage(ctx, cbuffer->buffer, &data);
+
+        buf = pdf_load_raw_stream(ctx, doc, e->num, 0);
+        same = fz_buffer_storage(ctx, buf, &other) == len && memcmp(data, other, len) == 0;
+    } fz_always(ctx) {
+        fz_drop_buffer(ctx, buf);
+    } fz_catch(ctx) {
+        same = 0;
+    }
+
+    return same;
+}
+
+
+static void img_entry_pix(fz_context *ctx, pdf_document *doc, img_index *index, img_entry *e) {
+    // an image added by this fill may have no stream yet
+    for(int i = 0; i < index->job_len; i++) {
+        if(index->jobs[i]->num == e->num) {
+            img_finish(ctx, doc, index);
+            break;
+        }
+    }
+
+    pdf_obj *obj = pdf_new_indirect(ctx, doc, e->num, 0);
+    fz_image *image = NULL;
+
+    e->key.pix_state = -1;
+
+    fz_var(image);
+    fz_try(ctx) {
+        image = pdf_load_image(ctx, doc, obj);
+        e->key.pix_hash = u_fz_hash_image(ctx, image);
+        e->key.pix_state = 1;
+    } fz_always(ctx) {
+        fz_drop_image(ctx, image);
+        pdf_drop_obj(ctx, obj);
+    } fz_catch(ctx) {
+        e->key.pix_state = -1;
+    }
+}
+
+
+static void img_add_entry(img_index *index, int num, img_key *key) {
+    if(index->len == index->cap) {
+        index->cap = index->cap ? index->cap * 2 : INIT_CAP;
+        index->entries = realloc(index->entries, sizeof(img_entry) * index->cap);
+    }
+
+    index->entries[index->len].num = num;
+    index->entries[index->len].key = *key;
+    index->len++;
+}
+
+
+img_index *img_new_index(fz_context *ctx, pdf_document *doc) {
+    img_index *index = calloc(1, sizeof(img_index));
+    pdf_obj *obj = NULL;
+    img_key key;
+
+    fz_var(obj);
+    fz_try(ctx) {
+        int len = pdf_count_objects(ctx, doc);
+
+        for(int k = 1; k < len; k++) {
+            obj = pdf_new_indirect(ctx, doc, k, 0);
+
+            if(pdf_name_eq(ctx, pdf_dict_get(ctx, obj, PDF_NAME_Subtype), PDF_NAME_Image)) {
+                memset(&key, 0, sizeof(img_key));
+                key.w = pdf_to_int(ctx, pdf_dict_get(ctx, obj, PDF_NAME_Width));
+                key.h = pdf_to_int(ctx, pdf_dict_get(ctx, obj, PDF_NAME_Height));
+                key.bpc = pdf_to_int(ctx, pdf_dict_get(ctx, obj, PDF_NAME_BitsPerComponent));
+
+                if(pdf_dict_get(ctx, obj, PDF_NAME_SMask) || pdf_dict_get(ctx, obj, PDF_NAME_Mask))
+                    key.enc_state = key.pix_state = -1;
+
+                img_add_entry(index, k, &key);
+            }
+
+            pdf_drop_obj(ctx, obj);
+            obj = NULL;
+        }
+    } fz_always(ctx) {
+        pdf_drop_obj(ctx, obj);
+    } fz_catch(ctx) {
+        img_drop_index(ctx, index);
+        fz_rethrow(ctx);
+    }
+
+    return index;
+}
+
+
+// returns a new reference to an image in the document that matches image, or NULL. key is set for img_insert
+pdf_obj *img_find(fz_context *ctx, pdf_document *doc, img_index *index, fz_image *image, img_key *key) {
+    img_new_key(ctx, image, key);
+
+    if(key->enc_state == 1) {
+        for(int i = 0; i < index->len; i++) {
+            img_entry *e = &index->entries[i];
+
+            if(e->key.w != key->w || e->key.h != key->h || e->key.bpc != key->bpc)
+                continue;
+
+            if(e->key.enc_state == 0)
+                img_entry_enc(ctx, doc, e);
+
+            if(e->key.enc_state == 1 && e->key.enc_len == key->enc_len && e->key.enc_hash == key->enc_hash
+               && img_same_bytes(ctx, doc, e, image))
+                return pdf_new_indirect(ctx, doc, e->num, 0);
+        }
+    }
+
+    // the same pixels may be encoded differently, decode only the candidates of the same size
+    for(int i = 0; i < index->len && key->pix_state != -1; i++) {
+        img_entry *e = &index->entries[i];
+
+        if(e->key.w != key->w || e->key.h != key->h || e->key.pix_state == -1)
+            continue;
+
+        if(key->pix_state == 0) {
+            key->pix_hash = u_fz_hash_image(ctx, image);
+            key->pix_state = 1;
+        }
+
+        if(e->key.pix_state == 0)
+            img_entry_pix(ctx, doc, index, e);
+
+        if(e->key.pix_state == 1 && e->key.pix_hash == key->pix_hash)
+            return pdf_new_indirect(ctx, doc, e->num, 0);
+    }
+
+    return NULL;
+}
+
+
+void img_insert(fz_context *ctx, img_index *index, pdf_obj *ref, img_key *key) {
+    img_add_entry(index, pdf_to_num(ctx, ref), key);
+}
+
+
+static int img_paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+    if(pa <= pb && pa <= pc)
+        return a;
+
+    return pb <= pc ? b : c;
+}
+
+
+// PNG predictor rows for 8 bit samples. each row gets the filter type giving the smallest sum of absolute
+// differences, the usual heuristic for what deflates best
+static unsigned char *img_predict(const unsigned char *src, int w, int h, int n, size_t *len) {
+    size_t row = (size_t) w * n;
+    unsigned char *out = malloc((row + 1) * h);
+    unsigned char *cand = malloc(row * 5);
+
+    if(out == NULL || cand == NULL) {
+        free(out);
+        free(cand);
+        return NULL;
+    }
+
+    for(int y = 0; y < h; y++) {
+        const unsigned char *cur = src + row * y;
+        const unsigned char *prev = y ? cur - row : NULL;
+        unsigned long sums[5] = {0};
+
+        for(size_t x = 0; x < row; x++) {
+            int a = x >= (size_t) n ? cur[x - n] : 0;
+            int b = prev ? prev[x] : 0;
+            int c = (prev && x >= (size_t) n) ? prev[x - n] : 0;
+
+            cand[x] = cur[x];
+            cand[row + x] = cur[x] - a;
+            cand[row * 2 + x] = cur[x] - b;
+            cand[row * 3 + x] = cur[x] - ((a + b) >> 1);
+            cand[row * 4 + x] = cur[x] - img_paeth(a, b, c);
+
+            for(int f = 0; f < 5; f++)
+                sums[f] += abs((signed char) cand[row * f + x]);
+        }
+
+        int best = 0;
+        for(int f = 1; f < 5; f++) {
+            if(sums[f] < sums[best])
+                best = f;
+        }
+
+        unsigned char *o = out + (row + 1) * y;
+        o[0] = best;
+        memcpy(o + 1, cand + row * best, row);
+    }
+
+    free(cand);
+    *len = (row + 1) * h;
+
+    return out;
+}
+
+
+// runs without a fz_context, it only reads job->src and allocates with malloc
+static void *img_deflate_job(void *arg) {
+    img_job *job = arg;
+    size_t len;
+    unsigned char *predicted = img_predict(job->src, job->w, job->h, job->n, &len);
+
+    if(predicted == NULL) {
+        job->error = 1;
+        return NULL;
+    }
+
+    job->data = dfl_compress(predicted, len, &job->data_len);
+
+    if(job->data == NULL)
+        job->error = 1;
+
+    free(predicted);
+
+    return NULL;
+}
+
+
+// ref's stream will be the w x h x n samples deflated with PNG predictors, written by img_finish
+void img_deflate_stream(fz_context *ctx, pdf_document *doc, img_index *index, pdf_obj *ref, fz_buffer *samples, int w, int h, int n) {
+    pdf_obj *parms = pdf_new_dict(ctx, doc, 4);
+
+    pdf_dict_put_drop(ctx, ref, PDF_NAME_DecodeParms, parms);
+    pdf_dict_put_drop(ctx, parms, PDF_NAME_Predictor, pdf_new_int(ctx, doc, 15));
+    pdf_dict_put_drop(ctx, parms, PDF_NAME_Colors, pdf_new_int(ctx, doc, n));
+    pdf_dict_put_drop(ctx, parms, PDF_NAME_BitsPerComponent, pdf_new_int(ctx, doc, 8));
+    pdf_dict_put_drop(ctx, parms, PDF_NAME_Columns, pdf_new_int(ctx, doc, w));
+    pdf_dict_put_drop(ctx, ref, PDF_NAME_Filter, PDF_NAME_FlateDecode);
+
+    if(index->job_len == index->job_cap) {
+        index->job_cap = index->job_cap ? index->job_cap * 2 : INIT_CAP;
+        index->jobs = realloc(index->jobs, sizeof(img_job *) * index->job_cap);
+    }
+
+    img_job *job = calloc(1, sizeof(img_job));
+    job->num = pdf_to_num(ctx, ref);
+    job->samples = fz_keep_buffer(ctx, samples);
+    fz_buffer_storage(ctx, samples, (unsigned char **) &job->src);
+    job->w = w;
+    job->h = h;
+    job->n = n;
+    index->jobs[index->job_len++] = job;
+
+    job->started = pthread_create(&job->thread, NULL, img_deflate_job, job) == 0;
+
+    if(!job->started)
+        img_deflate_job(job);
+}
+
+
+static void img_drop_jobs(fz_context *ctx, img_index *index) {
+    for(int i = 0; i < index->job_len; i++) {
+        img_job *job = index->jobs[i];
+
+        if(job->started)
+            pthread_join(job->thread, NULL);
+
+        fz_drop_buffer(ctx, job->samples);
+        free(job->data);
+        free(job);
+    }
+
+    index->job_len = 0;
+}
+
+
+// wait for the deflating threads and write their streams, called before the document is saved
+void img_finish(fz_context *ctx, pdf_document *doc, img_index *index) {
+    fz_buffer *buf = NULL;
+    pdf_obj *obj = NULL;
+
+    for(int i = 0; i < index->job_len; i++) {
+        if(index->jobs[i]->started) {
+            pthread_join(index->jobs[i]->thread, NULL);
+            index->jobs[i]->started = 0;
+        }
+    }
+
+    fz_var(buf);
+    fz_var(obj);
+    fz_try(ctx) {
+        for(int i = 0; i < index->job_len; i++) {
+            img_job *job = index->jobs[i];
+
+            if(job->error)
+                fz_throw(ctx, FZ_ERROR_GENERIC, "cannot deflate image %d", job->num);
+
+            buf = fz_new_buffer(ctx, job->data_len);
+            fz_write_buffer(ctx, buf, job->data, job->data_len);
+            obj = pdf_new_indirect(ctx, doc, job->num, 0);
+            pdf_update_stream(ctx, doc, obj, buf, 1);
+
+            pdf_drop_obj(ctx, obj);
+            obj = NULL;
+            fz_drop_buffer(ctx, buf);
+            buf = NULL;
+        }
+    } fz_always(ctx) {
+        pdf_drop_obj(ctx, obj);
+        fz_drop_buffer(ctx, buf);
+        img_drop_jobs(ctx, index);
+    } fz_catch(ctx) {
+        fz_rethrow(ctx);
+    }
+}
+
+
+void img_drop_index(fz_context *ctx, img_index *index) {
+    if(index == NULL)
+        return;
+
+    img_drop_jobs(ctx, index);
+    free(index->jobs);
+    free(index->entries);
+    free(index);
+}
+
+
+// resample image to w x h, no larger than the source, averaging the block of source pixels under each target
+// pixel. a mask is resampled with it. returns a new image
+fz_image *img_downsample(fz_context *ctx, fz_image *image, int w, int h) {
+    fz_pixmap *src = NULL, *dst = NULL;
+    fz_image *mask = NULL, *result = NULL;
+    int *xspan = NULL;
+    uint64_t *sums = NULL;
+
+    fz_var(src);
+    fz_var(dst);
+    fz_var(mask);
+    fz_var(xspan);
+    fz_var(sums);
+    fz_try(ctx) {
+        src = fz_get_pixmap_from_image(ctx, image, NULL, NULL, NULL, NULL);
+
+        if(w > src->w) w = src->w;
+        if(h > src->h) h = src->h;
+
+        if(image->mask)
+            mask = img_downsample(ctx, image->mask, w, h);
+
+        int n = src->n;
+        dst = fz_new_pixmap(ctx, src->colorspace, w, h, src->alpha);
+        xspan = fz_malloc_array(ctx, w + 1, sizeof(int));
+        sums = fz_malloc_array(ctx, w * n, sizeof(uint64_t));
+
+        for(int x = 0; x <= w; x++)
+            xspan[x] = (int) ((int64_t) x * src->w / w);
+
+        for(int y = 0; y < h; y++) {
+            int sy0 = (int) ((int64_t) y * src->h / h);
+            int sy1 = (int) ((int64_t) (y + 1) * src->h / h);
+
+            memset(sums, 0, sizeof(uint64_t) * w * n);
+
+            for(int sy = sy0; sy < sy1; sy++) {
+                const unsigned char *s = src->samples + (size_t) sy * src->stride;
+                uint64_t *acc = sums;
+
+                for(int x = 0; x < w; x++, acc += n) {
+                    for(int sx = xspan[x]; sx < xspan[x + 1]; sx++) {
+                        for(int c = 0; c < n; c++)
+                            acc[c] += s[sx * n + c];
+                    }
+                }
+            }
+
+            unsigned char *d = dst->samples + (size_t) y * dst->stride;
+
+            for(int x = 0; x < w; x++) {
+                uint64_t area = (uint64_t) (xspan[x + 1] - xspan[x]) * (sy1 - sy0);
+
+                for(int c = 0; c < n; c++)
+                    d[x * n + c] = (unsigned char) ((sums[x * n + c] + area / 2) / area);
+            }
+        }
+
+        result = fz_new_image_from_pixmap(ctx, dst, mask);
+    } fz_always(ctx) {
+        fz_drop_image(ctx, mask);
+        fz_drop_pixmap(ctx, dst);
+        fz_drop_pixmap(ctx, src);
+        fz_free(ctx, xspan);
+        fz_free(ctx, sums);
+    } fz_catch(ctx) {
+        fz_rethrow(ctx);
+    }
+
+    return result;
+}
+
+
+// alpha split kernels. the samples of a pixmap with alpha are interleaved, colour first and alpha last. the
+// SSSE3 kernels are chosen at run time, NEON is always there on aarch64, other layouts use the scalar loop.
+
+static void img_split_row(const unsigned char *s, int w, int n, unsigned char *color, unsigned char *alpha) {
+    int cn = n - 1;
+
+    for(int x = 0; x < w; x++) {
+        for(int c = 0; c < cn; c++)
+            *color++ = *s++;
+
+        if(alpha)
+            *alpha++ = *s;
+        s++;
+    }
+}
+
+#ifdef IMG_X86
+// 16 pixels per pass, returns the count split
+__attribute__((target("ssse3")))
+static int img_split_row_ssse3(const unsigned char *s, int w, int n, unsigned char *color, unsigned char *alpha) {
+    int x = 0;
+
+    if(n == 4) {
+        const __m128i cmask = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+        const __m128i amask = _mm_setr_epi8(3, 7, 11, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+
+        for(; x + 16 <= w; x += 16, s += 64, color += 48) {
+            __m128i v0 = _mm_loadu_si128((const __m128i *) s);
+            __m128i v1 = _mm_loadu_si128((const __m128i *) (s + 16));
+            __m128i v2 = _mm_loadu_si128((const __m128i *) (s + 32));
+            __m128i v3 = _mm_loadu_si128((const __m128i *) (s + 48));
+            __m128i c0 = _mm_shuffle_epi8(v0, cmask);
+            __m128i c1 = _mm_shuffle_epi8(v1, cmask);
+            __m128i c2 = _mm_shuffle_epi8(v2, cmask);
+            __m128i c3 = _mm_shuffle_epi8(v3, cmask);
+
+            _mm_storeu_si128((__m128i *) color, _mm_or_si128(c0, _mm_slli_si128(c1, 12)));
+            _mm_storeu_si128((__m128i *) (color + 16), _mm_or_si128(_mm_srli_si128(c1, 4), _mm_slli_si128(c2, 8)));
+            _mm_storeu_si128((__m128i *) (color + 32), _mm_or_si128(_mm_srli_si128(c2, 8), _mm_slli_si128(c3, 4)));
+
+            if(alpha) {
+                __m128i a = _mm_or_si128(
+                    _mm_or_si128(_mm_shuffle_epi8(v0, amask), _mm_slli_si128(_mm_shuffle_epi8(v1, amask), 4)),
+                    _mm_or_si128(_mm_slli_si128(_mm_shuffle_epi8(v2, amask), 8), _mm_slli_si128(_mm_shuffle_epi8(v3, amask), 12)));
+                _mm_storeu_si128((__m128i *) alpha, a);
+                alpha += 16;
+            }
+        }
+    } else if(n == 2) {
+        const __m128i gmask = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, -1, -1, -1, -1, -1, -1, -1, -1);
+        const __m128i amask = _mm_setr_epi8(1, 3, 5, 7, 9, 11, 13, 15, -1, -1, -1, -1, -1, -1, -1, -1);
+
+        for(; x + 16 <= w; x += 16, s += 32, color += 16) {
+            __m128i v0 = _mm_loadu_si128((const __m128i *) s);
+            __m128i v1 = _mm_loadu_si128((const __m128i *) (s + 16));
+
+            _mm_storeu_si128((__m128i *) color,
+                _mm_or_si128(_mm_shuffle_epi8(v0, gmask), _mm_slli_si128(_mm_shuffle_epi8(v1, gmask), 8)));
+
+            if(alpha) {
+                _mm_storeu_si128((__m128i *) alpha,
+                    _mm_or_si128(_mm_shuffle_epi8(v0, amask), _mm_slli_si128(_mm_shuffle_epi8(v1, amask), 8)));
+                alpha += 16;
+            }
+        }
+    }
+
+    return x;
+}
+#endif
+
+#ifdef IMG_NEON
+static int img_split_row_neon(const unsigned char *s, int w, int n, unsigned char *color, unsigned char *alpha) {
+    int x = 0;
+
+    if(n == 4) {
+        for(; x + 16 <= w; x += 16, s += 64, color += 48) {
+            uint8x16x4_t v = vld4q_u8(s);
+            uint8x16x3_t c = {{ v.val[0], v.val[1], v.val[2] }};
+
+            vst3q_u8(color, c);
+            if(alpha) {
+                vst1q_u8(alpha, v.val[3]);
+                alpha += 16;
+            }
+        }
+    } else if(n == 2) {
+        for(; x + 16 <= w; x += 16, s += 32, color += 16) {
+            uint8x16x2_t v = vld2q_u8(s);
+
+            vst1q_u8(color, v.val[0]);
+            if(alpha) {
+                vst1q_u8(alpha, v.val[1]);
+                alpha += 16;
+            }
+        }
+    }
+
+    return x;
+}
+#endif
+
+
+// 1 if every alpha sample of the w x h pixmap is 255
+int img_alpha_opaque(const unsigned char *src, int stride, int w, int h, int n) {
+    for(int y = 0; y < h; y++) {
+        const unsigned char *s = src + (size_t) y * stride;
+        unsigned char acc = 0xff;
+        int x = 0;
+
+#if defined(IMG_X86) && defined(__SSE2__)
+        if(n == 4 || n == 2) {
+            const __m128i cmask = n == 4 ? _mm_set1_epi32(0x00ffffff) : _mm_set1_epi16(0x00ff);
+            __m128i vacc = _mm_set1_epi8(-1);
+
+            for(; x + 16 / n <= w; x += 16 / n)
+                vacc = _mm_and_si128(vacc, _mm_loadu_si128((const __m128i *) (s + x * n)));
+
+            if(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(vacc, cmask), _mm_set1_epi8(-1))) != 0xffff)
+                return 0;
+        }
+#elif defined(IMG_NEON)
+        if(n == 4 || n == 2) {
+            uint8x16_t vacc = vdupq_n_u8(0xff);
+
+            if(n == 4) {
+                for(; x + 16 <= w; x += 16)
+                    vacc = vandq_u8(vacc, vld4q_u8(s + x * 4).val[3]);
+            } else {
+                for(; x + 16 <= w; x += 16)
+                    vacc = vandq_u8(vacc, vld2q_u8(s + x * 2).val[1]);
+            }
+
+            if(vminvq_u8(vacc) != 0xff)
+                return 0;
+        }
+#endif
+
+        for(; x < w; x++)
+            acc &= s[x * n + n - 1];
+
+        if(acc != 0xff)
+            return 0;
+    }
+
+    return 1;
+}
+
+
+// split a w x h pixmap of n samples, alpha last, into packed colour and alpha planes. alpha may be NULL
+void img_split_alpha(const unsigned char *src, int stride, int w, int h, int n, unsigned char *color, unsigned char *alpha) {
+    int cn = n - 1;
+#ifdef IMG_X86
+    int ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+
+    for(int y = 0; y < h; y++) {
+        const unsigned char *s = src + (size_t) y * stride;
+        unsigned char *c = color + (size_t) y * w * cn;
+        unsigned char *a = alpha ? alpha + (size_t) y * w : NULL;
+        int x = 0;
+
+#ifdef IMG_X86
+        if(ssse3)
+            x = img_split_row_ssse3(s, w, n, c, a);
+#elif defined(IMG_NEON)
+        x = img_split_row_neon(s, w, n, c, a);
+#endif
+
+        img_split_row(s + x * n, w - x, n, c + x * cn, a ? a + x : NULL);
+    }
+}
+
+
+// the image to embed for one placed w x h points in size. larger than max_dpi it is resampled down, otherwise
+// a new reference to image is returned
+fz_image *img_fit_dpi(fz_context *ctx, fz_image *image, float w, float h, float max_dpi) {
+    if(max_dpi <= 0 || w <= 0 || h <= 0)
+        return fz_keep_image(ctx, image);
+
+    float scale_w = w * max_dpi / 72 / image->w;
+    float scale_h = h * max_dpi / 72 / image->h;
+    float scale = scale_w > scale_h ? scale_w : scale_h;
+
+    if(scale >= 1)
+        return fz_keep_image(ctx, image);
+
+    int tw = (int) (image->w * scale + 0.5f);
+    int th = (int) (image->h * scale + 0.5f);
+
+    return img_downsample(ctx, image, tw > 0 ? tw : 1, th > 0 ? th : 1);
+}
@@ -0,0 +1,176 @@
+#include <mupdf/fitz.h>
+#include <mupdf/pdf.h>
+#include <string.h>
+#include <stdlib.h>
+#include "fill.h"
+
+// a per-page widget index, built with one pass over page->annots. widgets are found by object number,
+// by fully qualified field name ("topmostSubform[0].Page1[0].f1_1[0]") and by the terminal field's own name.
+
+
+static uint32_t idx_hash_str(const char *str) {
+    uint32_t h = 2166136261u;
+
+    while(*str) {
+        h ^= (unsigned char) *str++;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+static uint32_t idx_hash_int(int num) {
+    return (uint32_t) num * 2654435761u;
+}
+
+
+// the fully qualified name joins the /T of the field and its parents with '.'
+char *idx_field_name(fz_context *ctx, pdf_obj *field) {
+    char *parts[IDX_MAX_DEPTH];
+    int depth = 0, len = 0;
+
+    while(field && depth < IDX_MAX_DEPTH) {
+        pdf_obj *t = pdf_dict_get(ctx, field, PDF_NAME_T);
+
+        if(t) {
+            parts[depth] = pdf_to_utf8(ctx, t);
+            len += strlen(parts[depth]) + 1;
+            depth++;
+        }
+
+        field = pdf_dict_get(ctx, field, PDF_NAME_Parent);
+    }
+
+    if(depth == 0)
+        return NULL;
+
+    char *name = fz_malloc(ctx, len);
+    char *p = name;
+
+    while(depth-- > 0) {
+        int part_len = strlen(parts[depth]);
+        memcpy(p, parts[depth], part_len);
+        p += part_len;
+        *p++ = depth ? '.' : 0;
+        fz_free(ctx, parts[depth]);
+    }
+
+    return name;
+}
+
+
+// returns 1 if the index took ownership of name, 0 if the name was already there
+static int idx_put_name(widget_index *index, char *name, pdf_widget *widget, int replace) {
+    uint32_t h = idx_hash_str(name);
+    uint32_t i = h & index->mask;
+
+    while(index->names[i].name) {
+        if(index->names[i].hash == h && strcmp(index->names[i].name, name) == 0) {
+            if(replace)
+                index->names[i].widget = widget;
+            return 0;
+        }
+
+        i = (i + 1) & index->mask;
+    }
+
+    index->names[i].name = name;
+    index->names[i].hash = h;
+    index->names[i].widget = widget;
+    return 1;
+}
+
+
+widget_index *idx_new_page_index(fz_context *ctx, pdf_page *page) {
+    int count = 0, cap = 16;
+    pdf_annot *annot;
+
+    for(annot = page->annots; annot; annot = annot->next)
+        count++;
+
+    // two names per widget, at most half full
+    while(cap < count * 4)
+        cap *= 2;
+
+    widget_index *index = fz_malloc_struct(ctx, widget_index);
+    index->mask = cap - 1;
+    index->ids = fz_calloc(ctx, cap, sizeof(idx_id_entry));
+    index->names = fz_calloc(ctx, cap, sizeof(idx_name_entry));
+
+    fz_try(ctx) {
+        for(annot = page->annots; annot; annot = annot->next) {
+            if(pdf_annot_type(ctx, annot) != PDF_ANNOT_WIDGET)
+                continue;
+
+            int num = pdf_to_num(ctx, annot->obj);
+            uint32_t i = idx_hash_int(num) & index->mask;
+
+            while(index->ids[i].widget && index->ids[i].num != num)
+                i = (i + 1) & index->mask;
+
+            index->ids[i].num = num;
+            index->ids[i].widget = (pdf_widget *) annot;
+
+            char *full_name = idx_field_name(ctx, annot->obj);
+            if(full_name == NULL)
+                continue;
+
+            // the terminal name is only a fallback, a fully qualified name always wins
+            char *short_name = strrchr(full_name, '.');
+            char *dup = short_name ? fz_strdup(ctx, short_name + 1) : NULL;
+
+            if(!idx_put_name(index, full_name, (pdf_widget *) annot, 1))
+                fz_free(ctx, full_name);
+
+            if(dup && !idx_put_name(index, dup, (pdf_widget *) annot, 0))
+                fz_free(ctx, dup);
+        }
+    } fz_catch(ctx) {
+        idx_drop(ctx, index);
+        fz_rethrow(ctx);
+    }
+
+    return index;
+}
+
+
+pdf_widget *idx_find_id(widget_index *index, int num) {
+    uint32_t i = idx_hash_int(num) & index->mask;
+
+    while(index->ids[i].widget) {
+        if(index->ids[i].num == num)
+            return index->ids[i].widget;
+
+        i = (i + 1) & index->mask;
+    }
+
+    return NULL;
+}
+
+
+pdf_widget *idx_find_name(widget_index *index, const char *name) {
+    uint32_t h = idx_hash_str(name);
+    uint32_t i = h & index->mask;
+
+    while(index->names[i].name) {
+        if(index->names[i].hash == h && strcmp(index->names[i].name, name) == 0)
+            return index->names[i].widget;
+
+        i = (i + 1) & index->mask;
+    }
+
+    return NULL;
+}
+
+
+void idx_drop(fz_context *ctx, widget_index *index) {
+    if(index == NULL)
+        return;
+
+    for(uint32_t i = 0; i <= index->mask; i++)
+        fz_free(ctx, index->names[i].name);
+
+    fz_free(ctx, index->ids);
+    fz_free(ctx, index->names);
+    fz_free(ctx, index);
+}
@@ -88,7 +88,6 @@ static int map_color_value(json_t *jsn_obj, const char *property, float *color,
 fill_type map_input_signature(pdf_env *env) {
     const char *sigfile = NULL;
     json_t *json_sigfile = NULL, *json_font = NULL, *json_sz = NULL, *json_text = NULL, *json_pwd;
-    struct stat buffer;
 
     if(!map_input_rectpos(env->fill.json_map_item, &env->fill.sig.pos, "rect", "pos", DEFAULT_SIG_WIDTH, DEFAULT_SIG_HEIGHT)) {
         RETURN_FILL_ERROR("Pos/rect item for signature not given");
@@ -97,6 +96,7 @@ fill_type map_input_signature(pdf_env *env) {
     env->fill.sig.widget_name = env->fill.input_key;
     env->fill.sig.page_num = env->page_num;
     env->fill.sig.visible = 1;
+    env->fill.sig.signer = NULL;
 
     if(!map_data_font(env->fill.json_map_item, &env->fill.sig.font, &env->fill.sig.fontsize, NULL)) {
         RETURN_FILL_ERROR("No font");
@@ -112,11 +112,8 @@ fill_type map_input_signature(pdf_env *env) {
         RETURN_FILL_ERROR("Sigfile not set");
     }
 
-    if(stat(sigfile, &buffer) != 0) {
-        RETURN_FILL_ERROR_ARG("Sigfile %s not found", sigfile);
-    } else {
-        env->fill.sig.file = sigfile;
-    }
+    // the file is checked when the signer cache decodes it
+    env->fill.sig.file = sigfile;
 
     json_pwd = json_object_get(env->fill.json_map_item, "password");
     if(env->fill.certPwd) {
@@ -193,6 +190,9 @@ fill_type map_input_image(pdf_env *env) {
     json_t *json_fname = json_object_get(env->fill.json_map_item, "src");
     env->fill.img.file_name = json_string_value(json_fname);
 
+    // 0 leaves it to the --max-dpi default
+    env->fill.img.max_dpi = map_input_number(env->fill.json_map_item, "max_dpi", 0, 0);
+
     return ADD_IMAGE;
 }
 
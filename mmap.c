@@ -0,0 +1,249 @@
+#include <mupdf/fitz.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fill.h"
+
+// input pdfs are mapped read only rather than read into memory. every thread, and every forked zygote child, opening
+// the same base reads the same page cache pages. the fz_buffer handed out shares the mapping's bytes, documents
+// are opened on it with a stream that reads it in place. a mapping is counted once for the buffer and once for each
+// open stream, the last one unmaps it.
+//
+// a mapping faults once its file is truncated, so the forms serve and zygote keep for their lifetime are read
+// into memory instead, see cmplt_read_resident.
+
+#define MM_TAIL_ADVICE (64 * 1024)
+
+typedef struct mm_map {
+    unsigned char *data;
+    size_t len;
+    int refs;
+    struct mm_map *next;
+} mm_map;
+
+static pthread_mutex_t mm_lock = PTHREAD_MUTEX_INITIALIZER;
+static mm_map *mm_maps = NULL;
+
+
+static mm_map *mm_find(fz_context *ctx, fz_buffer *buf) {
+    unsigned char *data;
+    size_t len = fz_buffer_storage(ctx, buf, &data);
+    mm_map *map;
+
+    for(map = mm_maps; map; map = map->next) {
+        if(map->data == data && map->len == len)
+            break;
+    }
+
+    return map;
+}
+
+
+static void mm_release(mm_map *map) {
+    pthread_mutex_lock(&mm_lock);
+
+    if(--map->refs > 0) {
+        pthread_mutex_unlock(&mm_lock);
+        return;
+    }
+
+    for(mm_map **p = &mm_maps; *p; p = &(*p)->next) {
+        if(*p == map) {
+            *p = map->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&mm_lock);
+
+    munmap(map->data, map->len);
+    free(map);
+}
+
+
+// a buffer sharing the len bytes mapped at data, which it unmaps
+static fz_buffer *mm_new_buffer(fz_context *ctx, const char *path, unsigned char *data, size_t len) {
+    // opening reads the header, then startxref, the trailer and the xref at the end of the file
+    long page = sysconf(_SC_PAGESIZE);
+    size_t tail = len > MM_TAIL_ADVICE ? (len - MM_TAIL_ADVICE) & ~(size_t) (page - 1) : 0;
+    madvise(data, len < (size_t) page ? len : (size_t) page, MADV_WILLNEED);
+    madvise(data + tail, len - tail, MADV_WILLNEED);
+
+    mm_map *map = malloc(sizeof(mm_map));
+    fz_buffer *buf = NULL;
+
+    fz_try(ctx) {
+        if(map == NULL)
+            fz_throw(ctx, FZ_ERROR_GENERIC, "cannot map '%s'", path);
+
+        buf = fz_new_buffer_from_shared_data(ctx, (const char *) data, len);
+    } fz_catch(ctx) {
+        free(map);
+        munmap(data, len);
+        fz_rethrow(ctx);
+    }
+
+    map->data = data;
+    map->len = len;
+    map->refs = 1;
+
+    pthread_mutex_lock(&mm_lock);
+    map->next = mm_maps;
+    mm_maps = map;
+    pthread_mutex_unlock(&mm_lock);
+
+    return buf;
+}
+
+
+// returns a buffer sharing a read only mapping of path, or NULL when the file can't be mapped
+fz_buffer *mm_map_file(fz_context *ctx, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if(fd < 0)
+        return NULL;
+
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t len = st.st_size;
+    unsigned char *data = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(data == MAP_FAILED)
+        return NULL;
+
+    return mm_new_buffer(ctx, path, data, len);
+}
+
+
+// as mm_map_file, followed by tail_len bytes of tail. the pages holding only the file's bytes are still shared,
+// the one the file ends in is a private copy the tail starts in and the rest of the tail is in anonymous pages.
+// returns NULL when path can't be mapped or isn't the file st describes
+fz_buffer *mm_map_file_tail(fz_context *ctx, const char *path, struct stat *st, const unsigned char *tail, size_t tail_len) {
+    struct stat now;
+    int fd = open(path, O_RDONLY);
+
+    if(fd < 0)
+        return NULL;
+
+    if(fstat(fd, &now) != 0 || now.st_dev != st->st_dev || now.st_ino != st->st_ino || now.st_size != st->st_size
+       || now.st_mtim.tv_sec != st->st_mtim.tv_sec || now.st_mtim.tv_nsec != st->st_mtim.tv_nsec || now.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len = now.st_size;
+    size_t full = len & ~(page - 1);
+    size_t span = (len + tail_len + page - 1) & ~(page - 1);
+
+    // reserved as anonymous pages, the file's are mapped over the start of it
+    unsigned char *data = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    int ok = data != MAP_FAILED;
+
+    if(ok && full > 0)
+        ok = mmap(data, full, PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED;
+
+    if(ok && len > full)
+        ok = mmap(data + full, page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, full) != MAP_FAILED;
+
+    close(fd);
+
+    if(!ok) {
+        if(data != MAP_FAILED)
+            munmap(data, span);
+
+        return NULL;
+    }
+
+    memcpy(data + len, tail, tail_len);
+    mprotect(data + full, span - full, PROT_READ);
+
+    return mm_new_buffer(ctx, path, data, len + tail_len);
+}
+
+
+// 1 if buf is a mapping from mm_map_file
+int mm_is_mapped(fz_context *ctx, fz_buffer *buf) {
+    pthread_mutex_lock(&mm_lock);
+    mm_map *map = mm_find(ctx, buf);
+    pthread_mutex_unlock(&mm_lock);
+
+    return map != NULL;
+}
+
+
+static int mm_next(fz_context *ctx, fz_stream *stm, size_t max) {
+    return EOF;
+}
+
+
+// as mupdf's buffer stream, the whole file is always between rp and wp
+static void mm_seek(fz_context *ctx, fz_stream *stm, fz_off_t offset, int whence) {
+    fz_off_t pos = stm->pos - (stm->wp - stm->rp);
+
+    if(whence == 1)
+        offset += pos;
+    else if(whence == 2)
+        offset += stm->pos;
+
+    if(offset < 0)
+        offset = 0;
+    if(offset > stm->pos)
+        offset = stm->pos;
+
+    stm->rp += offset - pos;
+}
+
+
+static void mm_close(fz_context *ctx, void *state) {
+    mm_release(state);
+}
+
+
+// a stream over buf, reading a mapping in place. other buffers get mupdf's buffer stream
+fz_stream *mm_open_buffer(fz_context *ctx, fz_buffer *buf) {
+    pthread_mutex_lock(&mm_lock);
+    mm_map *map = mm_find(ctx, buf);
+    if(map)
+        map->refs++;
+    pthread_mutex_unlock(&mm_lock);
+
+    if(map == NULL)
+        return fz_open_buffer(ctx, buf);
+
+    // fz_new_stream calls mm_close itself when it fails
+    fz_stream *stm = fz_new_stream(ctx, map, mm_next, mm_close);
+
+    stm->seek = mm_seek;
+    stm->rp = map->data;
+    stm->wp = map->data + map->len;
+    stm->pos = map->len;
+
+    return stm;
+}
+
+
+// drop a buffer from cmplt_read_input, unmapping it once no stream reads it
+void mm_drop_buffer(fz_context *ctx, fz_buffer *buf) {
+    if(buf == NULL)
+        return;
+
+    pthread_mutex_lock(&mm_lock);
+    mm_map *map = mm_find(ctx, buf);
+    pthread_mutex_unlock(&mm_lock);
+
+    fz_drop_buffer(ctx, buf);
+
+    if(map)
+        mm_release(map);
+}
@@ -0,0 +1,392 @@
+#include <mupdf/fitz.h>
+#include <mupdf/pdf.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "fill.h"
+
+// a PDF 1.5 writer for --objstm. changed objects that aren't streams are packed OSTM_MAX_OBJS at a time into
+// deflated object streams, the cross reference is a deflated xref stream. an incremental save writes the objects
+// of the document's incremental section after the base file, a full rewrite writes every object into a new file.
+//
+// mupdf's writer is still used for signed and encrypted documents, the signature's byte range and the encryption
+// of strings in an object stream aren't handled here.
+
+#define OSTM_MAX_OBJS 100
+
+typedef struct {
+    int num;
+    int type;       // 0 free, 1 at an offset, 2 in an object stream
+    int64_t field2; // offset or object stream number
+    int field3;     // generation or index in the object stream
+} ostm_row;
+
+typedef struct {
+    fz_context *ctx;
+    pdf_document *doc;
+    fz_buffer *out;
+
+    ostm_row *rows;
+    int row_len;
+    int row_cap;
+    int next_num;
+
+    // the object stream being filled
+    int stm_num;
+    int stm_count;
+    fz_buffer *stm_head;
+    fz_buffer *stm_body;
+} ostm_writer;
+
+
+static void ostm_add_row(ostm_writer *w, int num, int type, int64_t field2, int field3) {
+    if(w->row_len == w->row_cap) {
+        w->row_cap = w->row_cap ? w->row_cap * 2 : INIT_CAP;
+        w->rows = fz_resize_array(w->ctx, w->rows, w->row_cap, sizeof(ostm_row));
+    }
+
+    ostm_row *row = &w->rows[w->row_len++];
+    row->num = num;
+    row->type = type;
+    row->field2 = field2;
+    row->field3 = field3;
+}
+
+
+static int64_t ostm_offset(ostm_writer *w) {
+    return fz_buffer_storage(w->ctx, w->out, NULL);
+}
+
+
+static void ostm_print(ostm_writer *w, fz_buffer *buf, pdf_obj *obj) {
+    fz_output *out = fz_new_output_with_buffer(w->ctx, buf);
+
+    fz_try(w->ctx) {
+        pdf_print_obj(w->ctx, out, obj, 1);
+    } fz_always(w->ctx) {
+        fz_drop_output(w->ctx, out);
+    } fz_catch(w->ctx) {
+        fz_rethrow(w->ctx);
+    }
+}
+
+
+// write a stream object with dict and already encoded data, the /Length is set here
+static void ostm_write_stream(ostm_writer *w, int num, int gen, pdf_obj *dict, const unsigned char *data, size_t len) {
+    pdf_dict_put_drop(w->ctx, dict, PDF_NAME_Length, pdf_new_int(w->ctx, w->doc, (int) len));
+
+    ostm_add_row(w, num, 1, ostm_offset(w), gen);
+    fz_buffer_printf(w->ctx, w->out, "%d %d obj\n", num, gen);
+    ostm_print(w, w->out, dict);
+    fz_write_buffer(w->ctx, w->out, "\nstream\n", 8);
+    fz_write_buffer(w->ctx, w->out, (void *) data, len);
+    fz_write_buffer(w->ctx, w->out, "\nendstream\nendobj\n", 18);
+}
+
+
+static void ostm_flush_stream(ostm_writer *w) {
+    fz_context *ctx = w->ctx;
+    fz_buffer *packed = NULL, *deflated = NULL;
+    pdf_obj *dict = NULL;
+    unsigned char *data;
+    size_t len;
+
+    if(w->stm_count == 0)
+        return;
+
+    fz_var(packed);
+    fz_var(deflated);
+    fz_var(dict);
+    fz_try(ctx) {
+        size_t first = fz_buffer_storage(ctx, w->stm_head, NULL);
+
+        packed = fz_new_buffer(ctx, first + fz_buffer_storage(ctx, w->stm_body, NULL));
+        fz_append_buffer(ctx, packed, w->stm_head);
+        fz_append_buffer(ctx, packed, w->stm_body);
+
+        len = fz_buffer_storage(ctx, packed, &data);
+        deflated = dfl_compress_buffer(ctx, data, len);
+        len = fz_buffer_storage(ctx, deflated, &data);
+
+        dict = pdf_new_dict(ctx, w->doc, 5);
+        pdf_dict_put(ctx, dict, PDF_NAME_Type, PDF_NAME_ObjStm);
+        pdf_dict_put_drop(ctx, dict, PDF_NAME_N, pdf_new_int(ctx, w->doc, w->stm_count));
+        pdf_dict_put_drop(ctx, dict, PDF_NAME_First, pdf_new_int(ctx, w->doc, (int) first));
+        pdf_dict_put(ctx, dict, PDF_NAME_Filter, PDF_NAME_FlateDecode);
+
+        ostm_write_stream(w, w->stm_num, 0, dict, data, len);
+    } fz_always(ctx) {
+        pdf_drop_obj(ctx, dict);
+        fz_drop_buffer(ctx, packed);
+        fz_drop_buffer(ctx, deflated);
+    } fz_catch(ctx) {
+        fz_rethrow(ctx);
+    }
+
+    fz_drop_buffer(ctx, w->stm_head);
+    fz_drop_buffer(ctx, w->stm_body);
+    w->stm_head = w->stm_body = NULL;
+    w->stm_count = 0;
+}
+
+
+static void ostm_pack_object(ostm_writer *w, int num, pdf_obj *obj) {
+    if(w->stm_count == 0) {
+        w->stm_num = w->next_num++;
+        w->stm_head = fz_new_buffer(w->ctx, 1024);
+        w->stm_body = fz_new_buffer(w->ctx, 16384);
+    }
+
+    fz_buffer_printf(w->ctx, w->stm_head, "%d %d ", num, (int) fz_buffer_storage(w->ctx, w->stm_body, NULL));
+    ostm_print(w, w->stm_body, obj);
+    fz_write_buffer(w->ctx, w->stm_body, "\n", 1);
+
+    ostm_add_row(w, num, 2, w->stm_num, w->stm_count++);
+
+    if(w->stm_count == OSTM_MAX_OBJS)
+        ostm_flush_stream(w);
+}
+
+
+static int ostm_is_stream(fz_context *ctx, pdf_document *doc, int num) {
+    pdf_xref_entry *entry = pdf_get_xref_entry(ctx, doc, num);
+    return entry->type == 'n' && (entry->stm_ofs != 0 || entry->stm_buf != NULL);
+}
+
+
+static void ostm_write_object(ostm_writer *w, int num, int full) {
+    fz_context *ctx = w->ctx;
+    pdf_xref_entry *entry = pdf_get_xref_entry(ctx, w->doc, num);
+    pdf_obj *obj = NULL, *dict = NULL;
+    fz_buffer *raw = NULL, *deflated = NULL;
+
+    if(entry->type != 'n' && entry->type != 'o') {
+        ostm_add_row(w, num, 0, 0, num == 0 ? 65535 : entry->gen + 1);
+        return;
+    }
+
+    fz_var(obj);
+    fz_var(dict);
+    fz_var(raw);
+    fz_var(deflated);
+    fz_try(ctx) {
+        int gen = entry->type == 'o' ? 0 : entry->gen;
+
+        obj = pdf_load_object(ctx, w->doc, num, gen);
+
+        if(ostm_is_stream(ctx, w->doc, num)) {
+            pdf_obj *type = pdf_dict_get(ctx, obj, PDF_NAME_Type);
+
+            // a rewrite packs its own object streams and xref
+            if(full && (pdf_name_eq(ctx, type, PDF_NAME_ObjStm) || pdf_name_eq(ctx, type, PDF_NAME_XRef))) {
+                ostm_add_row(w, num, 0, 0, gen + 1);
+            } else {
+                unsigned char *data;
+                raw = pdf_load_raw_stream(ctx, w->doc, num, gen);
+                size_t len = fz_buffer_storage(ctx, raw, &data);
+
+                dict = pdf_copy_dict(ctx, obj);
+
+                // mupdf keeps the streams it makes, appearances and embedded fonts, unfiltered
+                if(pdf_dict_get(ctx, dict, PDF_NAME_Filter) == NULL) {
+                    unsigned char *packed;
+                    deflated = dfl_compress_buffer(ctx, data, len);
+                    size_t packed_len = fz_buffer_storage(ctx, deflated, &packed);
+
+                    if(packed_len < len) {
+                        pdf_dict_put(ctx, dict, PDF_NAME_Filter, PDF_NAME_FlateDecode);
+                        pdf_dict_del(ctx, dict, PDF_NAME_DecodeParms);
+                        data = packed;
+                        len = packed_len;
+                    }
+                }
+
+                ostm_write_stream(w, num, gen, dict, data, len);
+            }
+        } else if(gen != 0) {
+            // objects in an object stream have generation 0
+            ostm_add_row(w, num, 1, ostm_offset(w), gen);
+            fz_buffer_printf(ctx, w->out, "%d %d obj\n", num, gen);
+            ostm_print(w, w->out, obj);
+            fz_write_buffer(ctx, w->out, "\nendobj\n", 8);
+        } else {
+            ostm_pack_object(w, num, obj);
+        }
+    } fz_always(ctx) {
+        pdf_drop_obj(ctx, obj);
+        pdf_drop_obj(ctx, dict);
+        fz_drop_buffer(ctx, raw);
+        fz_drop_buffer(ctx, deflated);
+    } fz_catch(ctx) {
+        fz_rethrow(ctx);
+    }
+}
+
+
+static int ostm_cmp_row(const void *a, const void *b) {
+    return ((ostm_row *) a)->num - ((ostm_row *) b)->num;
+}
+
+
+static void ostm_put_be(unsigned char *p, int64_t v, int bytes) {
+    while(bytes-- > 0) {
+        p[bytes] = v & 0xff;
+        v >>= 8;
+    }
+}
+
+
+static void ostm_write_xref(ostm_writer *w, int full) {
+    fz_context *ctx = w->ctx;
+    pdf_obj *trailer = pdf_trailer(ctx, w->doc);
+    pdf_obj *dict = NULL, *index = NULL, *wids = NULL;
+    fz_buffer *rows = NULL, *deflated = NULL;
+    int xref_num = w->next_num++;
+    int64_t xref_ofs = ostm_offset(w);
+
+    ostm_add_row(w, xref_num, 1, xref_ofs, 0);
+
+    if(full)
+        ostm_add_row(w, 0, 0, 0, 65535);
+
+    qsort(w->rows, w->row_len, sizeof(ostm_row), ostm_cmp_row);
+
+    int w2 = 1;
+    for(int i = 0; i < w->row_len; i++) {
+        while(w2 < 8 && (w->rows[i].field2 >> (w2 * 8)) != 0)
+            w2++;
+    }
+
+    fz_var(dict);
+    fz_var(index);
+    fz_var(wids);
+    fz_var(rows);
+    fz_var(deflated);
+    fz_try(ctx) {
+        unsigned char row[1 + 8 + 2];
+        char tail[64];
+        unsigned char *data;
+        size_t len;
+
+        rows = fz_new_buffer(ctx, w->row_len * (3 + w2));
+        index = pdf_new_array(ctx, w->doc, 8);
+
+        for(int i = 0, start = 0; i < w->row_len; i++) {
+            ostm_row *r = &w->rows[i];
+
+            // consecutive numbers make one /Index subsection
+            if(i == w->row_len - 1 || w->rows[i + 1].num != r->num + 1) {
+                pdf_array_push_drop(ctx, index, pdf_new_int(ctx, w->doc, w->rows[start].num));
+                pdf_array_push_drop(ctx, index, pdf_new_int(ctx, w->doc, i - start + 1));
+                start = i + 1;
+            }
+
+            row[0] = r->type;
+            ostm_put_be(row + 1, r->field2, w2);
+            ostm_put_be(row + 1 + w2, r->field3, 2);
+            fz_write_buffer(ctx, rows, row, 3 + w2);
+        }
+
+        len = fz_buffer_storage(ctx, rows, &data);
+        deflated = dfl_compress_buffer(ctx, data, len);
+        len = fz_buffer_storage(ctx, deflated, &data);
+
+        wids = pdf_new_array(ctx, w->doc, 3);
+        pdf_array_push_drop(ctx, wids, pdf_new_int(ctx, w->doc, 1));
+        pdf_array_push_drop(ctx, wids, pdf_new_int(ctx, w->doc, w2));
+        pdf_array_push_drop(ctx, wids, pdf_new_int(ctx, w->doc, 2));
+
+        dict = pdf_new_dict(ctx, w->doc, 10);
+        pdf_dict_put(ctx, dict, PDF_NAME_Type, PDF_NAME_XRef);
+        pdf_dict_put_drop(ctx, dict, PDF_NAME_Size, pdf_new_int(ctx, w->doc, w->next_num));
+        pdf_dict_put(ctx, dict, PDF_NAME_W, wids);
+        pdf_dict_put(ctx, dict, PDF_NAME_Index, index);
+        pdf_dict_put(ctx, dict, PDF_NAME_Root, pdf_dict_get(ctx, trailer, PDF_NAME_Root));
+
+        if(pdf_dict_get(ctx, trailer, PDF_NAME_Info))
+            pdf_dict_put(ctx, dict, PDF_NAME_Info, pdf_dict_get(ctx, trailer, PDF_NAME_Info));
+        if(pdf_dict_get(ctx, trailer, PDF_NAME_ID))
+            pdf_dict_put(ctx, dict, PDF_NAME_ID, pdf_dict_get(ctx, trailer, PDF_NAME_ID));
+        if(!full)
+            pdf_dict_put_drop(ctx, dict, PDF_NAME_Prev, pdf_new_int(ctx, w->doc, (int) w->doc->startxref));
+
+        pdf_dict_put(ctx, dict, PDF_NAME_Filter, PDF_NAME_FlateDecode);
+
+        // the xref stream's own row is already added, so it isn't written with ostm_write_stream
+        pdf_dict_put_drop(ctx, dict, PDF_NAME_Length, pdf_new_int(ctx, w->doc, (int) len));
+        fz_buffer_printf(ctx, w->out, "%d 0 obj\n", xref_num);
+        ostm_print(w, w->out, dict);
+        fz_write_buffer(ctx, w->out, "\nstream\n", 8);
+        fz_write_buffer(ctx, w->out, data, len);
+        fz_write_buffer(ctx, w->out, "\nendstream\nendobj\n", 18);
+        snprintf(tail, sizeof(tail), "startxref\n%lld\n%%%%EOF\n", (long long) xref_ofs);
+        fz_write_buffer(ctx, w->out, tail, strlen(tail));
+    } fz_always(ctx) {
+        pdf_drop_obj(ctx, dict);
+        pdf_drop_obj(ctx, index);
+        pdf_drop_obj(ctx, wids);
+        fz_drop_buffer(ctx, rows);
+        fz_drop_buffer(ctx, deflated);
+    } fz_catch(ctx) {
+        fz_rethrow(ctx);
+    }
+}
+
+
+// the later of the header's version and the catalog's, as 10 * major + minor
+static int ostm_version(fz_context *ctx, pdf_document *doc) {
+    pdf_obj *version = pdf_dict_getp(ctx, pdf_trailer(ctx, doc), "Root/Version");
+    int major, minor;
+
+    if(pdf_is_name(ctx, version) && sscanf(pdf_to_name(ctx, version), "%d.%d", &major, &minor) == 2
+       && major * 10 + minor > doc->version)
+        return major * 10 + minor;
+
+    return doc->version;
+}
+
+
+// 1 if ostm_write can save doc, otherwise the caller saves with mupdf
+int ostm_can_write(fz_context *ctx, pdf_document *doc) {
+    return pdf_dict_get(ctx, pdf_trailer(ctx, doc), PDF_NAME_Encrypt) == NULL;
+}
+
+
+// append the save of doc to out. for an incremental save out holds the file doc was opened from, for a full
+// rewrite it is empty
+void ostm_write(fz_context *ctx, pdf_document *doc, fz_buffer *out, int full) {
+    ostm_writer w;
+    int xref_len = pdf_xref_len(ctx, doc);
+    size_t base_len = fz_buffer_storage(ctx, out, NULL);
+
+    memset(&w, 0, sizeof(w));
+    w.ctx = ctx;
+    w.doc = doc;
+    w.out = out;
+    w.next_num = xref_len;
+
+    fz_try(ctx) {
+        // object streams need 1.5, a header can't be changed incrementally but the catalog's /Version can
+        if(!full && ostm_version(ctx, doc) < 15)
+            pdf_dict_put_drop(ctx, pdf_dict_get(ctx, pdf_trailer(ctx, doc), PDF_NAME_Root), PDF_NAME_Version, pdf_new_name(ctx, doc, "1.5"));
+
+        if(full)
+            fz_write_buffer(ctx, out, "%PDF-1.5\n%\xe2\xe3\xcf\xd3\n", 15);
+        else if(base_len > 0)
+            fz_write_buffer(ctx, out, "\n", 1);
+
+        for(int num = 1; num < xref_len; num++) {
+            if(full || pdf_xref_is_incremental(ctx, doc, num))
+                ostm_write_object(&w, num, full);
+        }
+
+        ostm_flush_stream(&w);
+        ostm_write_xref(&w, full);
+    } fz_always(ctx) {
+        fz_drop_buffer(ctx, w.stm_head);
+        fz_drop_buffer(ctx, w.stm_body);
+        fz_free(ctx, w.rows);
+    } fz_catch(ctx) {
+        fz_rethrow(ctx);
+    }
+}
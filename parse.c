@@ -242,6 +242,12 @@ void visit_field_jsonlist(pdf_env *env, pdf_widget *widget, int widget_num) {
 
     json_object_set_new(jsobj, "type", json_string(get_type_name(env->ctx, widget)));
 
+    char *full_name = idx_field_name(env->ctx, ((pdf_annot *) widget)->obj);
+    if(full_name) {
+        json_object_set_new(jsobj, "fullname", json_string(full_name));
+        fz_free(env->ctx, full_name);
+    }
+
     fz_rect rect;
     pdf_annot_rect(env->ctx, (pdf_annot *) widget, &rect);
 
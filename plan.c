@@ -0,0 +1,471 @@
+#include <mupdf/fitz.h>
+#include <mupdf/pdf.h>
+#include <jansson.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fill.h"
+
+// compiled templates. 'fillpdf compile' checks a template against its pdf and resolves every item to a
+// plan_item: field names become object numbers and the add types' positions, fonts, colours and files are
+// parsed. the plan is written as a header, the page table, the items then a string table, in host byte order,
+// so 'complete -P' can map it and fill straight from it.
+
+typedef struct {
+    plan_page *pages;
+    int page_len, page_cap;
+
+    plan_item *items;
+    int item_len, item_cap;
+
+    char *strings;
+    uint32_t str_len, str_cap;
+} plan_builder;
+
+
+static uint32_t plan_add_str(plan_builder *pb, const char *str) {
+    if(str == NULL)
+        return PLAN_NO_STR;
+
+    uint32_t len = strlen(str) + 1;
+    uint32_t offset = pb->str_len;
+
+    while(pb->str_len + len > pb->str_cap) {
+        pb->str_cap = pb->str_cap ? pb->str_cap * 2 : 256;
+        pb->strings = realloc(pb->strings, pb->str_cap);
+    }
+
+    memcpy(pb->strings + offset, str, len);
+    pb->str_len += len;
+
+    return offset;
+}
+
+
+static plan_item *plan_add_item(plan_builder *pb) {
+    if(pb->item_len == pb->item_cap) {
+        pb->item_cap = pb->item_cap ? pb->item_cap * 2 : INIT_CAP;
+        pb->items = realloc(pb->items, sizeof(plan_item) * pb->item_cap);
+    }
+
+    plan_item *item = &pb->items[pb->item_len++];
+    memset(item, 0, sizeof(plan_item));
+
+    return item;
+}
+
+
+static plan_page *plan_add_page(plan_builder *pb, int page_num) {
+    if(pb->page_len == pb->page_cap) {
+        pb->page_cap = pb->page_cap ? pb->page_cap * 2 : INIT_CAP;
+        pb->pages = realloc(pb->pages, sizeof(plan_page) * pb->page_cap);
+    }
+
+    plan_page *page = &pb->pages[pb->page_len++];
+    page->page_num = page_num;
+    page->first_item = pb->item_len;
+    page->item_count = 0;
+
+    return page;
+}
+
+
+// resolve the template item in env->fill.json_map_item. returns 0 if it's invalid for this pdf
+static int plan_compile_item(pdf_env *env, plan_builder *pb, const char *key) {
+    pdf_widget *widget;
+    fill_type type;
+
+    env->fill.input_key = key;
+    type = map_input_data(env);
+
+    if(type == FILL_DATA_INVALID)
+        return 0;
+
+    plan_item *item = plan_add_item(pb);
+    item->type = type;
+    item->key = plan_add_str(pb, key);
+
+    switch(type) {
+        case FIELD_ID:
+            if((widget = cmplt_find_widget_id(env, env->fill.field_id)) == NULL) {
+                fprintf(stderr, "No widget with object id %d on page %d for key '%s'\n", env->fill.field_id, env->page_num, key);
+                return 0;
+            }
+
+            item->obj_num = env->fill.field_id;
+            break;
+
+        case FIELD_NAME:
+            if((widget = cmplt_find_widget_name(env, env->fill.field_name)) == NULL) {
+                fprintf(stderr, "No widget named '%s' on page %d for key '%s'\n", env->fill.field_name, env->page_num, key);
+                return 0;
+            }
+
+            // names are only looked up once, here
+            item->type = FIELD_ID;
+            item->obj_num = pdf_to_num(env->ctx, ((pdf_annot *) widget)->obj);
+            break;
+
+        case ADD_TEXTFIELD:
+        case ADD_TEXT:
+            item->pos = env->fill.text.pos;
+            item->editable = env->fill.text.editable;
+            item->font = plan_add_str(pb, env->fill.text.font);
+            item->fontfile = plan_add_str(pb, type == ADD_TEXT ? env->fill.text.fontfile : NULL);
+            item->fontsize = env->fill.text.fontsize;
+            memcpy(item->color, env->fill.text.color, sizeof(item->color));
+            break;
+
+        case ADD_SIGNATURE:
+            item->pos = env->fill.sig.pos;
+            item->font = plan_add_str(pb, env->fill.sig.font);
+            item->fontsize = env->fill.sig.fontsize;
+            // the password is never written, plans are copied around. it's given with -p when filling
+            item->file = plan_add_str(pb, env->fill.sig.file);
+            item->text = plan_add_str(pb, env->fill.sig.text);
+            item->gfx = plan_add_str(pb, env->fill.sig.gfx);
+            item->visible = env->fill.sig.visible;
+            break;
+
+        case ADD_IMAGE:
+            item->pos = env->fill.img.pos;
+            item->file = plan_add_str(pb, env->fill.img.file_name);
+            item->max_dpi = env->fill.img.max_dpi;
+            break;
+
+        default:
+            return 0;
+    }
+
+    return 1;
+}
+
+
+// the pdf's own bytes. base may have an xref sidecar's section after them, which is left out so a plan still
+// matches when a sidecar is added or removed
+static size_t plan_pdf_len(const char *input, fz_buffer *base, unsigned char **data) {
+    size_t len = fz_buffer_storage(NULL, base, data);
+    struct stat st;
+
+    if(strcmp(input, "-") != 0 && stat(input, &st) == 0 && (size_t) st.st_size <= len)
+        len = st.st_size;
+
+    return len;
+}
+
+
+static int plan_write(plan_builder *pb, const char *input, fz_buffer *base, const char *output) {
+    unsigned char *data;
+    size_t len = plan_pdf_len(input, base, &data);
+    plan_header header;
+    FILE *out = fopen(output, "w");
+
+    if(!out) {
+        fprintf(stderr, "Unable to write plan file '%s'\n", output);
+        return 0;
+    }
+
+    memcpy(header.magic, PLAN_MAGIC, 4);
+    header.version = PLAN_VERSION;
+    header.page_count = pb->page_len;
+    header.item_count = pb->item_len;
+    header.strings_len = pb->str_len;
+    header.reserved = 0;
+    header.pdf_size = len;
+    header.pdf_hash = hsh_bytes(data, len);
+
+    fwrite(&header, sizeof(plan_header), 1, out);
+    fwrite(pb->pages, sizeof(plan_page), pb->page_len, out);
+    fwrite(pb->items, sizeof(plan_item), pb->item_len, out);
+    fwrite(pb->strings, 1, pb->str_len, out);
+
+    return fclose(out) == 0;
+}
+
+
+// the compile command. nothing is written if any template item doesn't resolve against env->doc
+int plan_compile(pdf_env *env, fz_buffer *base) {
+    const char* obj_idx;
+    int page_idx, item_idx, errors = 0, retval = 0;
+    json_t *page_val;
+    plan_builder pb;
+    char *output = env->files.output;
+    char buf[BATCH_NAME_LEN];
+
+    memset(&pb, 0, sizeof(plan_builder));
+
+    json_t *template = cmplt_load_template(env->fill.tplFile);
+
+    if(template == NULL)
+        return 0;
+
+    fz_try(env->ctx) {
+        json_object_foreach(template, obj_idx, page_val) {
+            if(!str_is_all_digits(obj_idx) || !json_is_array(page_val))
+                continue;
+
+            sscanf(obj_idx, "%d", &page_idx);
+
+            if(page_idx < 0 || page_idx >= env->page_count) {
+                fprintf(stderr, "Template page %d is not in the pdf\n", page_idx);
+                errors++;
+                continue;
+            }
+
+            cmplt_load_page(env, page_idx);
+
+            plan_add_page(&pb, page_idx);
+            int first_item = pb.item_len;
+
+            json_array_foreach(page_val, item_idx, env->fill.json_map_item) {
+                json_t *datakey = json_object_get(env->fill.json_map_item, "key");
+
+                // items without a key are never filled
+                if(!json_is_string(datakey) || json_string_length(datakey) == 0)
+                    continue;
+
+                if(!plan_compile_item(env, &pb, json_string_value(datakey))) {
+                    fprintf(stderr, "Invalid template item %d on page %d\n", item_idx, page_idx);
+                    errors++;
+                }
+            }
+
+            pb.pages[pb.page_len - 1].item_count = pb.item_len - first_item;
+
+            cmplt_drop_page(env);
+        }
+    } fz_catch(env->ctx) {
+        fprintf(stderr, "cannot compile template: %s\n", fz_caught_message(env->ctx));
+        errors++;
+    }
+
+    if(output == NULL) {
+        int len = strlen(env->files.input);
+        len = (len > 4 && strcmp(env->files.input + len - 4, ".pdf") == 0) ? len - 4 : len;
+        snprintf(buf, BATCH_NAME_LEN, "%.*s.fplan", len, env->files.input);
+        output = buf;
+    }
+
+    if(errors) {
+        fprintf(stderr, "%d template error(s), plan not written\n", errors);
+    } else if(plan_write(&pb, env->files.input, base, output)) {
+        fprintf(stderr, "Compiled %d item(s) on %d page(s) to %s\n", pb.item_len, pb.page_len, output);
+        retval = 1;
+    }
+
+    free(pb.pages);
+    free(pb.items);
+    free(pb.strings);
+    json_decref(template);
+
+    return retval;
+}
+
+
+// filling trusts the mapped plan, so everything it indexes with is checked once here
+static const char *plan_check(fill_plan *plan) {
+    plan_header *header = plan->header;
+
+    if(header->strings_len > 0 && plan->strings[header->strings_len - 1] != 0)
+        return "string table isn't terminated";
+
+    for(uint32_t p = 0; p < header->page_count; p++) {
+        plan_page *page = &plan->pages[p];
+
+        if(page->first_item > header->item_count || page->item_count > header->item_count - page->first_item)
+            return "page items out of range";
+    }
+
+    for(uint32_t i = 0; i < header->item_count; i++) {
+        plan_item *item = &plan->items[i];
+
+        // compile resolves names to FIELD_ID
+        if(item->type < FIELD_ID || item->type > ADD_IMAGE || item->type == FIELD_NAME)
+            return "unknown item type";
+
+        if(item->key >= header->strings_len)
+            return "item without a key";
+    }
+
+    return NULL;
+}
+
+
+fill_plan *plan_load(const char *file) {
+    struct stat st;
+    int fd = open(file, O_RDONLY);
+
+    if(fd < 0 || fstat(fd, &st) != 0 || st.st_size < sizeof(plan_header)) {
+        fprintf(stderr, "Unable to read plan file '%s'\n", file);
+        if(fd >= 0) close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(map == MAP_FAILED) {
+        fprintf(stderr, "Unable to map plan file '%s'\n", file);
+        return NULL;
+    }
+
+    plan_header *header = map;
+    size_t expected = sizeof(plan_header) + sizeof(plan_page) * (size_t) header->page_count
+                    + sizeof(plan_item) * (size_t) header->item_count + header->strings_len;
+
+    if(memcmp(header->magic, PLAN_MAGIC, 4) != 0 || header->version != PLAN_VERSION || expected != (size_t) st.st_size) {
+        fprintf(stderr, "'%s' is not a plan file for this version of fillpdf\n", file);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    fill_plan *plan = malloc(sizeof(fill_plan));
+    plan->map = map;
+    plan->size = st.st_size;
+    plan->header = header;
+    plan->pages = (plan_page *) (header + 1);
+    plan->items = (plan_item *) (plan->pages + header->page_count);
+    plan->strings = (const char *) (plan->items + header->item_count);
+
+    const char *error = plan_check(plan);
+
+    if(error) {
+        fprintf(stderr, "Invalid plan file '%s': %s\n", file, error);
+        plan_drop(plan);
+        return NULL;
+    }
+
+    return plan;
+}
+
+
+void plan_drop(fill_plan *plan) {
+    if(plan == NULL)
+        return;
+
+    munmap(plan->map, plan->size);
+    free(plan);
+}
+
+
+static const char *plan_str(fill_plan *plan, uint32_t offset) {
+    if(offset == PLAN_NO_STR || offset >= plan->header->strings_len)
+        return NULL;
+
+    return plan->strings + offset;
+}
+
+
+// copy the item's resolved data into env->fill, as map_input_data would from the template
+static fill_type plan_map_item(pdf_env *env, fill_plan *plan, plan_item *item) {
+    switch(item->type) {
+        case FIELD_ID:
+            env->fill.field_id = item->obj_num;
+            break;
+
+        case ADD_TEXTFIELD:
+        case ADD_TEXT:
+            env->fill.text.pos = item->pos;
+            env->fill.text.editable = item->editable;
+            env->fill.text.font = plan_str(plan, item->font);
+            env->fill.text.fontfile = plan_str(plan, item->fontfile);
+            env->fill.text.fontsize = item->fontsize;
+            memcpy(env->fill.text.color, item->color, sizeof(item->color));
+            break;
+
+        case ADD_SIGNATURE:
+            env->fill.sig.pos = item->pos;
+            env->fill.sig.widget_name = env->fill.input_key;
+            env->fill.sig.font = plan_str(plan, item->font);
+            env->fill.sig.fontsize = item->fontsize;
+            env->fill.sig.file = env->fill.certFile ? env->fill.certFile : plan_str(plan, item->file);
+            env->fill.sig.password = env->fill.certPwd;
+            env->fill.sig.text = plan_str(plan, item->text);
+            env->fill.sig.gfx = plan_str(plan, item->gfx);
+            env->fill.sig.visible = item->visible;
+            env->fill.sig.page_num = env->page_num;
+            env->fill.sig.signer = NULL;
+            break;
+
+        case ADD_IMAGE:
+            env->fill.img.pos = item->pos;
+            env->fill.img.file_name = plan_str(plan, item->file);
+            env->fill.img.max_dpi = item->max_dpi;
+            break;
+
+        default:
+            return FILL_DATA_INVALID;
+    }
+
+    if(item->type == ADD_SIGNATURE && env->fill.sig.password == NULL)
+        fz_throw(env->ctx, FZ_ERROR_GENERIC, "plans don't hold the certificate password, sign with -p");
+
+    return item->type;
+}
+
+
+// throws unless the plan was compiled against the pdf read from input into base
+void plan_check_pdf(fz_context *ctx, fill_plan *plan, const char *input, fz_buffer *base) {
+    unsigned char *data;
+    size_t len = plan_pdf_len(input, base, &data);
+
+    if(plan->header->pdf_size != len || plan->header->pdf_hash != hsh_bytes(data, len))
+        fz_throw(ctx, FZ_ERROR_GENERIC, "plan was compiled for a different pdf");
+}
+
+
+// the plan equivalent of cmplt_fill_pages, plan_check_pdf has checked it matches env->doc
+int plan_fill_pages(pdf_env *env, fill_plan *plan, json_t *data_json) {
+    int updated_doc = 0;
+
+    env->fill.json_input_data = data_json;
+    env->add_sig = 0;
+
+    for(int p = 0; p < plan->header->page_count; p++) {
+        plan_page *page = &plan->pages[p];
+        int updated_pg = 0;
+
+        cmplt_load_page(env, page->page_num);
+
+        fz_try(env->ctx) {
+            for(int i = 0; i < page->item_count; i++) {
+                plan_item *item = &plan->items[page->first_item + i];
+
+                if(!cmplt_input_value(env, plan_str(plan, item->key)))
+                    continue;
+
+                fill_type type = plan_map_item(env, plan, item);
+
+                if(type == FIELD_ID) {
+                    pdf_widget *widget = cmplt_find_widget_id(env, env->fill.field_id);
+
+                    if(widget == NULL)
+                        fz_throw(env->ctx, FZ_ERROR_GENERIC, "stale plan: no widget %d on page %d", env->fill.field_id, env->page_num);
+
+                    updated_pg += cmplt_set_widget_value(env, widget, env->fill.input_data);
+                } else {
+                    updated_pg += cmplt_apply_field(env, type);
+                }
+            }
+
+            updated_pg += cmplt_flush_overlay(env);
+            updated_pg += cmplt_set_page_readonly(env->ctx, env->doc, env->page);
+
+            if(updated_pg && !env->fill.need_appearances) {
+                pdf_update_page(env->ctx, env->page);
+            }
+        } fz_always(env->ctx) {
+            cmplt_drop_page(env);
+        } fz_catch(env->ctx) {
+            fz_rethrow(env->ctx);
+        }
+
+        updated_doc += updated_pg;
+    }
+
+    return updated_doc;
+}
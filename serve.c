@@ -0,0 +1,524 @@
+#include <mupdf/fitz.h>
+#include <mupdf/pdf.h>
+#include <jansson.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include "fill.h"
+
+// the serve command, a fill daemon on a unix domain socket. forms stay resident, keyed by name, and
+// requests are framed json: a 4 byte big endian length followed by the payload.
+//
+//   {"op": "load", "form": name, "pdf": file, "template": file}    load (or add) a resident form
+//   {"op": "fill", "form": name, "data": {...}}                     fill a form, "op" defaults to fill
+//
+// every request gets a json header frame {"status": "ok"|"error", ...}. a successful fill's header
+// holds the "length" of the pdf, which follows in a second frame.
+//
+// the socket is created owner only, anyone who can connect can have the daemon read any file it can.
+
+// form is NULL while the name is reserved by a load in progress
+typedef struct {
+    char *name;
+    fill_form *form;
+} srv_entry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    srv_entry *forms;
+    int len;
+    int cap;
+} srv_registry;
+
+// a thread's own copy of a form's document, rolled back after each fill
+typedef struct {
+    fill_form *form;
+    doc_snapshot *snap;
+} srv_snapshot;
+
+typedef struct {
+    pthread_t thread;
+    pdf_env env;
+    int listen_fd;
+    int conn_fd;
+    srv_snapshot *snaps;
+    int snap_len;
+    int snap_cap;
+} srv_thread_env;
+
+static srv_registry registry = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+
+// connections are shut down once serving stops, so the threads serving them can be joined
+static pthread_mutex_t srv_conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static int srv_stopping = 0;
+
+
+// the caller holds registry.lock
+static srv_entry *srv_find_entry(const char *name) {
+    for(int i = 0; i < registry.len; i++) {
+        if(strcmp(registry.forms[i].name, name) == 0)
+            return &registry.forms[i];
+    }
+
+    return NULL;
+}
+
+
+static fill_form *srv_find_form(const char *name) {
+    pthread_mutex_lock(&registry.lock);
+
+    srv_entry *entry = srv_find_entry(name);
+    fill_form *form = entry ? entry->form : NULL;
+
+    pthread_mutex_unlock(&registry.lock);
+
+    return form;
+}
+
+
+// forms are never replaced or freed while serving, other threads may be filling them. the name is reserved
+// before the form is loaded so two loads of the same name can't both add it
+static int srv_add_form(pdf_env *env, const char *name, json_t *conf) {
+    pthread_mutex_lock(&registry.lock);
+
+    if(srv_find_entry(name) != NULL) {
+        pthread_mutex_unlock(&registry.lock);
+        fprintf(stderr, "Form '%s' already loaded\n", name);
+        return 0;
+    }
+
+    if(registry.len == registry.cap) {
+        registry.cap = registry.cap ? registry.cap * 2 : INIT_CAP;
+        registry.forms = realloc(registry.forms, sizeof(srv_entry) * registry.cap);
+    }
+
+    registry.forms[registry.len].name = strdup(name);
+    registry.forms[registry.len].form = NULL;
+    registry.len++;
+
+    pthread_mutex_unlock(&registry.lock);
+
+    fill_form *form = malloc(sizeof(fill_form));
+    int loaded = form_load(env, form, name, conf, 0);
+
+    if(!loaded) {
+        form_drop(env, form);
+        free(form);
+        form = NULL;
+    }
+
+    // other entries may have been added or removed meanwhile, the reservation is found again by name
+    pthread_mutex_lock(&registry.lock);
+
+    srv_entry *entry = srv_find_entry(name);
+
+    if(form) {
+        entry->form = form;
+    } else {
+        free(entry->name);
+        *entry = registry.forms[--registry.len];
+    }
+
+    pthread_mutex_unlock(&registry.lock);
+
+    return loaded;
+}
+
+
+static int srv_read_full(int fd, void *buf, size_t len) {
+    unsigned char *p = buf;
+
+    while(len > 0) {
+        ssize_t n = read(fd, p, len);
+
+        if(n < 0 && errno == EINTR)
+            continue;
+
+        if(n <= 0)
+            return 0;
+
+        p += n;
+        len -= n;
+    }
+
+    return 1;
+}
+
+
+static int srv_write_full(int fd, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+
+    while(len > 0) {
+        ssize_t n = write(fd, p, len);
+
+        if(n < 0 && errno == EINTR)
+            continue;
+
+        if(n <= 0)
+            return 0;
+
+        p += n;
+        len -= n;
+    }
+
+    return 1;
+}
+
+
+// returns a malloc'd, nul terminated payload or NULL at the end of the connection
+static char *srv_read_frame(int fd, uint32_t *len) {
+    uint32_t be_len;
+
+    if(!srv_read_full(fd, &be_len, 4))
+        return NULL;
+
+    *len = ntohl(be_len);
+
+    if(*len > SRV_MAX_FRAME) {
+        fprintf(stderr, "Request of %u bytes is too large\n", *len);
+        return NULL;
+    }
+
+    char *payload = malloc(*len + 1);
+
+    if(!srv_read_full(fd, payload, *len)) {
+        free(payload);
+        return NULL;
+    }
+
+    payload[*len] = 0;
+    return payload;
+}
+
+
+static int srv_write_frame(int fd, const void *data, uint32_t len) {
+    uint32_t be_len = htonl(len);
+
+    return srv_write_full(fd, &be_len, 4) && srv_write_full(fd, data, len);
+}
+
+
+static int srv_write_header(int fd, json_t *header) {
+    char *str = json_dumps(header, JSON_COMPACT);
+    int ok = srv_write_frame(fd, str, strlen(str));
+
+    free(str);
+    json_decref(header);
+
+    return ok;
+}
+
+
+static int srv_write_error(int fd, const char *msg) {
+    json_t *header = json_object();
+
+    json_object_set_new(header, "status", json_string("error"));
+    json_object_set_new(header, "message", json_string(msg));
+
+    return srv_write_header(fd, header);
+}
+
+
+static doc_snapshot *srv_find_snapshot(srv_thread_env *tenv, fill_form *form) {
+    for(int i = 0; i < tenv->snap_len; i++) {
+        if(tenv->snaps[i].form == form)
+            return tenv->snaps[i].snap;
+    }
+
+    if(tenv->snap_len == tenv->snap_cap) {
+        tenv->snap_cap = tenv->snap_cap ? tenv->snap_cap * 2 : INIT_CAP;
+        tenv->snaps = realloc(tenv->snaps, sizeof(srv_snapshot) * tenv->snap_cap);
+    }
+
+    srv_snapshot *entry = &tenv->snaps[tenv->snap_len++];
+    entry->form = form;
+    entry->snap = calloc(1, sizeof(doc_snapshot));
+
+    return entry->snap;
+}
+
+
+// fill the thread's pristine copy of the form's pdf and return the bytes of the completed file
+static fz_buffer *srv_fill(srv_thread_env *tenv, fill_form *form, json_t *data) {
+    pdf_env *env = &tenv->env;
+    fz_buffer *result = NULL;
+
+    env->doc = NULL;
+    env->snapshot = srv_find_snapshot(tenv, form);
+
+    fz_try(env->ctx) {
+        env->doc = snap_open(env->ctx, env->snapshot, form->base);
+
+        int updated_doc = cmplt_fill_pages(env, form->template, data);
+
+        result = cmplt_save_buffer(env, form->base, updated_doc);
+    } fz_catch(env->ctx) {
+        cmplt_drop_doc(env);
+        fz_rethrow(env->ctx);
+    }
+
+    return result;
+}
+
+
+// returns 0 when the connection should be closed
+static int srv_handle_request(srv_thread_env *tenv, int fd, const char *payload, uint32_t len) {
+    pdf_env *env = &tenv->env;
+    json_error_t json_err;
+    json_t *request = json_loadb(payload, len, 0, &json_err);
+    json_t *json_op = json_object_get(request, "op");
+    json_t *json_form = json_object_get(request, "form");
+    const char *op = json_is_string(json_op) ? json_string_value(json_op) : "fill";
+    int ok = 1;
+
+    if(!json_is_object(request) || !json_is_string(json_form)) {
+        ok = srv_write_error(fd, "request must be a json object with a 'form' name");
+    } else if(strcmp(op, "load") == 0) {
+        if(srv_add_form(env, json_string_value(json_form), request)) {
+            json_t *header = json_object();
+            json_object_set_new(header, "status", json_string("ok"));
+            ok = srv_write_header(fd, header);
+        } else {
+            ok = srv_write_error(fd, "cannot load form");
+        }
+    } else if(strcmp(op, "fill") == 0) {
+        fill_form *form = srv_find_form(json_string_value(json_form));
+        json_t *data = json_object_get(request, "data");
+        fz_buffer *result = NULL;
+
+        if(form == NULL) {
+            ok = srv_write_error(fd, "unknown form");
+        } else if(!json_is_object(data)) {
+            ok = srv_write_error(fd, "'data' must be a json object");
+        } else {
+            fz_var(result);
+            fz_try(env->ctx) {
+                result = srv_fill(tenv, form, data);
+            } fz_catch(env->ctx) {
+                result = NULL;
+            }
+
+            if(result) {
+                unsigned char *bytes;
+                size_t size = fz_buffer_storage(env->ctx, result, &bytes);
+                json_t *header = json_object();
+
+                json_object_set_new(header, "status", json_string("ok"));
+                json_object_set_new(header, "length", json_integer(size));
+
+                ok = srv_write_header(fd, header) && srv_write_frame(fd, bytes, size);
+                fz_drop_buffer(env->ctx, result);
+            } else {
+                ok = srv_write_error(fd, fz_caught_message(env->ctx));
+            }
+        }
+    } else {
+        ok = srv_write_error(fd, "unknown op");
+    }
+
+    json_decref(request);
+    return ok;
+}
+
+
+static void *srv_thread(void *arg) {
+    srv_thread_env *tenv = arg;
+    char *payload;
+    uint32_t len;
+
+    while(1) {
+        int fd = accept(tenv->listen_fd, NULL, NULL);
+
+        if(fd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            // once srv_stop shuts the socket down every accept fails
+            pthread_mutex_lock(&srv_conn_lock);
+            if(!srv_stopping)
+                perror("accept");
+            pthread_mutex_unlock(&srv_conn_lock);
+            break;
+        }
+
+        pthread_mutex_lock(&srv_conn_lock);
+        tenv->conn_fd = srv_stopping ? -1 : fd;
+        pthread_mutex_unlock(&srv_conn_lock);
+
+        if(tenv->conn_fd < 0) {
+            close(fd);
+            break;
+        }
+
+        while((payload = srv_read_frame(fd, &len)) != NULL) {
+            int ok = srv_handle_request(tenv, fd, payload, len);
+            free(payload);
+
+            if(!ok)
+                break;
+        }
+
+        pthread_mutex_lock(&srv_conn_lock);
+        tenv->conn_fd = -1;
+        pthread_mutex_unlock(&srv_conn_lock);
+
+        close(fd);
+    }
+
+    for(int i = 0; i < tenv->snap_len; i++)
+        snap_drop(tenv->env.ctx, tenv->snaps[i].snap);
+
+    free(tenv->snaps);
+
+    return NULL;
+}
+
+
+// wake every thread, in accept or reading a connection, so each returns from srv_thread
+static void srv_stop(srv_thread_env *threads, int count, int listen_fd) {
+    pthread_mutex_lock(&srv_conn_lock);
+
+    srv_stopping = 1;
+    shutdown(listen_fd, SHUT_RDWR);
+
+    for(int i = 0; i < count; i++) {
+        if(threads[i].conn_fd >= 0)
+            shutdown(threads[i].conn_fd, SHUT_RDWR);
+    }
+
+    pthread_mutex_unlock(&srv_conn_lock);
+}
+
+
+static int srv_listen(const char *path) {
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if(fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path '%s' is too long\n", path);
+        close(fd);
+        return -1;
+    }
+
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    // only the daemon's user may connect
+    mode_t mask = umask(0177);
+    int bound = bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0;
+    umask(mask);
+
+    if(!bound || listen(fd, SRV_BACKLOG) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+
+void srv_run(pdf_env *env) {
+    json_error_t json_err;
+    const char *form_name;
+    json_t *form_conf;
+
+    if(env->fill.socketFile == NULL) {
+        fprintf(stderr, "Error: serve needs a --socket path\n");
+        return;
+    }
+
+    if(env->files.input) {
+        json_t *config = json_load_file(env->files.input, 0, &json_err);
+
+        if(!json_is_object(config)) {
+            fprintf(stderr, "Invalid forms config '%s'. json root must be an object.\n", env->files.input);
+            json_decref(config);
+            return;
+        }
+
+        json_object_foreach(config, form_name, form_conf) {
+            srv_add_form(env, form_name, form_conf);
+        }
+
+        json_decref(config);
+    }
+
+    int listen_fd = srv_listen(env->fill.socketFile);
+
+    if(listen_fd < 0)
+        return;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    int srv_thread_count = env->fill.jobs > 1 ? env->fill.jobs : 1;
+    srv_thread_env *threads = malloc(sizeof(srv_thread_env) * srv_thread_count);
+
+    fprintf(stderr, "Serving on %s with %d thread(s)\n", env->fill.socketFile, srv_thread_count);
+
+    for(int i = 0; i < srv_thread_count; i++) {
+        memcpy(&threads[i].env, env, sizeof(pdf_env));
+        threads[i].env.ctx = (i == 0) ? env->ctx : fz_clone_context(env->ctx);
+        threads[i].env.doc = NULL;
+        threads[i].env.snapshot = NULL;
+        threads[i].env.doc_fonts = NULL;
+        threads[i].env.doc_font_len = threads[i].env.doc_font_cap = 0;
+        threads[i].listen_fd = listen_fd;
+        threads[i].conn_fd = -1;
+        threads[i].snaps = NULL;
+        threads[i].snap_len = threads[i].snap_cap = 0;
+
+        if(i > 0 && threads[i].env.ctx == NULL) {
+            fprintf(stderr, "cannot clone mupdf context for thread %d\n", i);
+            srv_thread_count = i;
+            break;
+        }
+    }
+
+    int started = 1;
+
+    for(; started < srv_thread_count; started++) {
+        if(pthread_create(&threads[started].thread, NULL, srv_thread, &threads[started]) != 0) {
+            fprintf(stderr, "cannot start thread %d\n", started);
+            break;
+        }
+    }
+
+    srv_thread(&threads[0]);
+
+    // thread 0 only returns when accept fails, the others are stopped and joined before their state is freed
+    srv_stop(threads, srv_thread_count, listen_fd);
+
+    for(int i = 1; i < srv_thread_count; i++) {
+        if(i < started)
+            pthread_join(threads[i].thread, NULL);
+    }
+
+    for(int i = 0; i < srv_thread_count; i++) {
+        fnt_free_doc_fonts(&threads[i].env);
+
+        if(i > 0)
+            fz_drop_context(threads[i].env.ctx);
+    }
+
+    close(listen_fd);
+    unlink(env->fill.socketFile);
+    free(threads);
+}
@@ -0,0 +1,110 @@
+#include <mupdf/fitz.h>
+#include <mupdf/pdf.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "fill.h"
+
+// decoded certificates, kept for the life of the process. reading a pfx decrypts the PKCS#12 container, which
+// is the slowest step of signing, so each is decoded once and looked up by (path, mtime, size, password hash).
+//
+// mupdf 1.10 doesn't lock a pdf_signer's reference count and every signed save keeps and drops it, so an entry
+// belongs to the thread that decoded it. a worker thread decodes a certificate once, not once per document.
+
+typedef struct {
+    char *path;
+    time_t mtime;
+    off_t size;
+    uint64_t pwd_hash;
+    pthread_t thread;
+    pdf_signer *signer;
+} sgn_entry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    sgn_entry *entries;
+    int len;
+    int cap;
+} sgn_cache;
+
+static sgn_cache cache = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+
+
+static pdf_signer *sgn_find(const char *path, struct stat *st, uint64_t pwd_hash, pthread_t thread) {
+    pdf_signer *signer = NULL;
+
+    pthread_mutex_lock(&cache.lock);
+
+    for(int i = 0; i < cache.len && signer == NULL; i++) {
+        sgn_entry *e = &cache.entries[i];
+
+        if(e->pwd_hash == pwd_hash && e->mtime == st->st_mtime && e->size == st->st_size
+                && pthread_equal(e->thread, thread) && strcmp(e->path, path) == 0)
+            signer = e->signer;
+    }
+
+    pthread_mutex_unlock(&cache.lock);
+
+    return signer;
+}
+
+
+// returns the decoded certificate in path, the cache keeps the reference. a changed file is decoded again, the
+// stale entry lives on until sgn_drop_all as a document being saved may still hold it.
+pdf_signer *sgn_get(fz_context *ctx, const char *path, const char *password) {
+    struct stat st;
+
+    if(path == NULL || password == NULL)
+        fz_throw(ctx, FZ_ERROR_GENERIC, "signing needs a sigfile and a password");
+
+    if(stat(path, &st) != 0)
+        fz_throw(ctx, FZ_ERROR_GENERIC, "Sigfile %s not found", path);
+
+    uint64_t pwd_hash = hsh_bytes(password, strlen(password));
+    pthread_t self = pthread_self();
+    pdf_signer *signer = sgn_find(path, &st, pwd_hash, self);
+
+    if(signer)
+        return signer;
+
+    // decoded outside the lock, only this thread adds entries for itself
+    signer = pdf_read_pfx(ctx, path, password);
+
+    pthread_mutex_lock(&cache.lock);
+
+    if(cache.len == cache.cap) {
+        cache.cap = cache.cap ? cache.cap * 2 : INIT_CAP;
+        cache.entries = realloc(cache.entries, sizeof(sgn_entry) * cache.cap);
+    }
+
+    sgn_entry *e = &cache.entries[cache.len++];
+    e->path = strdup(path);
+    e->mtime = st.st_mtime;
+    e->size = st.st_size;
+    e->pwd_hash = pwd_hash;
+    e->thread = self;
+    e->signer = signer;
+
+    pthread_mutex_unlock(&cache.lock);
+
+    return signer;
+}
+
+
+// called once every document is saved and the other threads have finished
+void sgn_drop_all(fz_context *ctx) {
+    pthread_mutex_lock(&cache.lock);
+
+    for(int i = 0; i < cache.len; i++) {
+        pdf_drop_signer(ctx, cache.entries[i].signer);
+        free(cache.entries[i].path);
+    }
+
+    free(cache.entries);
+    cache.entries = NULL;
+    cache.len = cache.cap = 0;
+
+    pthread_mutex_unlock(&cache.lock);
+}
@@ -0,0 +1,131 @@
+#include <mupdf/fitz.h>
+#include <mupdf/pdf.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "fill.h"
+
+// document snapshots, so batch and serve fill every record into one open document instead of reopening it. mupdf
+// puts each object a fill changes or creates in the document's incremental xref section, leaving a copy in the
+// section it came from, so the opened document is the base and that section the record's overlay. restoring
+// drops the overlay and forgets the base's copies of what it changed so those few objects are parsed again from
+// the file. a record costs the objects it touches, not the document.
+//
+// the signed and linearized saves rewrite the document as they go, their fills release the document instead.
+
+
+// the document opened from base, as it was when opened
+pdf_document *snap_open(fz_context *ctx, doc_snapshot *snap, fz_buffer *base) {
+    if(snap->doc)
+        return snap->doc;
+
+    snap->doc = cmplt_open_buffer(ctx, base);
+    snap->xref_len = pdf_xref_len(ctx, snap->doc);
+    snap->xref_sections = snap->doc->num_xref_sections;
+    snap->repaired = snap->doc->repair_attempted;
+
+    return snap->doc;
+}
+
+
+// the base's copy of num is loaded again the next time it's used
+static void snap_uncache(fz_context *ctx, pdf_document *doc, int num) {
+    pdf_xref_entry *entry = pdf_get_xref_entry(ctx, doc, num);
+
+    if(entry && (entry->type == 'n' || entry->type == 'o') && entry->obj) {
+        pdf_drop_obj(ctx, entry->obj);
+        entry->obj = NULL;
+    }
+}
+
+
+static void snap_drop_overlay(fz_context *ctx, doc_snapshot *snap, pdf_xref *overlay) {
+    pdf_xref_subsec *sub = overlay->subsec;
+
+    while(sub) {
+        pdf_xref_subsec *next = sub->next;
+
+        for(int i = 0; i < sub->len; i++) {
+            pdf_xref_entry *entry = &sub->table[i];
+
+            if(entry->type == 0)
+                continue;
+
+            if(sub->start + i < snap->xref_len)
+                snap_uncache(ctx, snap->doc, sub->start + i);
+
+            pdf_drop_obj(ctx, entry->obj);
+            fz_drop_buffer(ctx, entry->stm_buf);
+        }
+
+        fz_free(ctx, sub->table);
+        fz_free(ctx, sub);
+        sub = next;
+    }
+
+    pdf_drop_obj(ctx, overlay->trailer);
+    pdf_drop_obj(ctx, overlay->pre_repair_trailer);
+}
+
+
+// roll snap->doc back to the snapshot. a document that isn't just the base and one overlay, say it was repaired
+// during the fill, is dropped and snap_open opens it again
+void snap_restore(fz_context *ctx, doc_snapshot *snap) {
+    pdf_document *doc = snap->doc;
+    int overlays = doc->num_xref_sections - snap->xref_sections;
+
+    if(doc->repair_attempted != snap->repaired || doc->xref_base != 0 || doc->freeze_updates
+       || overlays < 0 || overlays > 1 || doc->num_incremental_sections != overlays
+       || (overlays == 1 && doc->xref_sections[0].unsaved_sigs != NULL)) {
+        snap_release(snap, doc);
+        pdf_drop_document(ctx, doc);
+        return;
+    }
+
+    if(overlays == 1) {
+        pdf_xref overlay = doc->xref_sections[0];
+
+        memmove(&doc->xref_sections[0], &doc->xref_sections[1], sizeof(pdf_xref) * snap->xref_sections);
+        doc->num_xref_sections--;
+        doc->num_incremental_sections = 0;
+
+        // xref_index is the section an object was last found in, where the next search for it starts
+        for(int i = 0; i < doc->max_xref_len; i++) {
+            if(doc->xref_index[i] > 0)
+                doc->xref_index[i]--;
+        }
+
+        snap_drop_overlay(ctx, snap, &overlay);
+    }
+
+    // the objects the fill created are gone
+    doc->max_xref_len = snap->xref_len;
+    doc->dirty = 0;
+
+    pdf_drop_obj(ctx, doc->focus_obj);
+    doc->focus_obj = NULL;
+
+    // resources mupdf loaded are keyed by object number, and the next fill reuses the numbers
+    pdf_empty_store(ctx, doc);
+
+    // so are the fonts and images pdf_add_simple_font and friends embedded, their tables are rebuilt as needed
+    pdf_drop_resource_tables(ctx, doc);
+    doc->resources.fonts = NULL;
+    doc->resources.images = NULL;
+}
+
+
+// the snapshot gives up doc, which its fill then drops as it would any other document
+void snap_release(doc_snapshot *snap, pdf_document *doc) {
+    if(snap && snap->doc == doc)
+        snap->doc = NULL;
+}
+
+
+void snap_drop(fz_context *ctx, doc_snapshot *snap) {
+    if(snap == NULL)
+        return;
+
+    pdf_drop_document(ctx, snap->doc);
+    free(snap);
+}
@@ -0,0 +1,261 @@
+#include <mupdf/fitz.h>
+#include <mupdf/pdf.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "fill.h"
+
+// fillpdf_test, built with -DBUILD_TESTS=ON and run by ctest. checks the parts a fill can't be seen to get wrong
+// from its output alone: snapshot rollback, the xref sidecar round trip and image dedupe. takes the example
+// directory, and works on copies of its pdfs in a temporary directory.
+
+#define TEST_CHECK(cond) do { \
+        if(!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failed++; \
+        } \
+    } while(0)
+
+static int failed = 0;
+
+
+// copies the example pdf name into dir, returns the copy's path in buf
+static void test_copy(fz_context *ctx, const char *examples, const char *dir, const char *name, char *buf, int buflen) {
+    char src[BATCH_NAME_LEN];
+    fz_buffer *data;
+
+    snprintf(src, BATCH_NAME_LEN, "%s/%s", examples, name);
+    snprintf(buf, buflen, "%s/%s", dir, name);
+
+    data = fz_read_file(ctx, src);
+
+    if(!cmplt_fwrite_buffer(ctx, data, buf)) {
+        fz_drop_buffer(ctx, data);
+        fz_throw(ctx, FZ_ERROR_GENERIC, "cannot copy '%s' to '%s'", src, buf);
+    }
+
+    fz_drop_buffer(ctx, data);
+}
+
+
+// a fill's changes and new objects are gone after snap_restore, and the document is kept rather than reopened
+static void test_snapshot(fz_context *ctx, const char *path) {
+    fz_buffer *base = cmplt_read_input(ctx, path);
+    doc_snapshot *snap = calloc(1, sizeof(doc_snapshot));
+
+    fz_try(ctx) {
+        pdf_document *doc = snap_open(ctx, snap, base);
+        int xref_len = pdf_xref_len(ctx, doc);
+        int pages = pdf_count_pages(ctx, doc);
+
+        TEST_CHECK(pdf_dict_gets(ctx, pdf_lookup_page_obj(ctx, doc, 0), "FillpdfTest") == NULL);
+
+        for(int round = 0; round < 2; round++) {
+            pdf_dict_puts_drop(ctx, pdf_lookup_page_obj(ctx, doc, 0), "FillpdfTest", pdf_new_int(ctx, doc, round));
+            pdf_drop_obj(ctx, pdf_add_object_drop(ctx, doc, pdf_new_dict(ctx, doc, 1)));
+
+            TEST_CHECK(doc->num_incremental_sections == 1);
+            TEST_CHECK(pdf_xref_len(ctx, doc) > xref_len);
+
+            snap_restore(ctx, snap);
+
+            // a document it couldn't roll back is dropped
+            if(snap->doc != doc)
+                fz_throw(ctx, FZ_ERROR_GENERIC, "snap_restore reopened the document");
+
+            TEST_CHECK(doc->num_incremental_sections == 0);
+            TEST_CHECK(pdf_xref_len(ctx, doc) == xref_len);
+            TEST_CHECK(pdf_count_pages(ctx, doc) == pages);
+            TEST_CHECK(pdf_dict_gets(ctx, pdf_lookup_page_obj(ctx, doc, 0), "FillpdfTest") == NULL);
+        }
+    } fz_always(ctx) {
+        snap_drop(ctx, snap);
+        mm_drop_buffer(ctx, base);
+    } fz_catch(ctx) {
+        fz_rethrow(ctx);
+    }
+}
+
+
+// the sidecar's table is appended and matches the pdf's own, and is ignored once the pdf's mtime changes
+static void test_sidecar(fz_context *ctx, const char *path) {
+    fz_buffer *plain = NULL, *cached = NULL, *stale = NULL;
+    pdf_document *plain_doc = NULL, *cached_doc = NULL;
+    struct stat st;
+
+    fz_var(plain);
+    fz_var(cached);
+    fz_var(stale);
+    fz_var(plain_doc);
+    fz_var(cached_doc);
+    fz_try(ctx) {
+        if(stat(path, &st) != 0)
+            fz_throw(ctx, FZ_ERROR_GENERIC, "cannot stat '%s'", path);
+
+        plain = cmplt_read_input(ctx, path);
+        TEST_CHECK(fz_buffer_storage(ctx, plain, NULL) == (size_t) st.st_size);
+
+        TEST_CHECK(xrc_write(ctx, path));
+
+        cached = cmplt_read_input(ctx, path);
+        TEST_CHECK(fz_buffer_storage(ctx, cached, NULL) > (size_t) st.st_size);
+
+        plain_doc = cmplt_open_buffer(ctx, plain);
+        cached_doc = cmplt_open_buffer(ctx, cached);
+
+        TEST_CHECK(!cached_doc->repair_attempted);
+        TEST_CHECK(pdf_count_pages(ctx, cached_doc) == pdf_count_pages(ctx, plain_doc));
+        TEST_CHECK(pdf_xref_len(ctx, cached_doc) == pdf_xref_len(ctx, plain_doc));
+
+        for(int num = 1; num < pdf_xref_len(ctx, plain_doc) && num < pdf_xref_len(ctx, cached_doc); num++) {
+            pdf_xref_entry *a = pdf_get_xref_entry(ctx, plain_doc, num);
+            pdf_xref_entry *b = pdf_get_xref_entry(ctx, cached_doc, num);
+
+            if(a->type == 'n' || a->type == 'o')
+                TEST_CHECK(b->type == a->type && b->ofs == a->ofs && b->gen == a->gen);
+        }
+
+        // a pdf rewritten since has a different mtime, its sidecar isn't used
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        times[1].tv_sec += 1;
+        if(utimensat(AT_FDCWD, path, times, 0) != 0)
+            fz_throw(ctx, FZ_ERROR_GENERIC, "cannot touch '%s'", path);
+
+        stale = cmplt_read_input(ctx, path);
+        TEST_CHECK(fz_buffer_storage(ctx, stale, NULL) == (size_t) st.st_size);
+    } fz_always(ctx) {
+        pdf_drop_document(ctx, cached_doc);
+        pdf_drop_document(ctx, plain_doc);
+        mm_drop_buffer(ctx, stale);
+        mm_drop_buffer(ctx, cached);
+        mm_drop_buffer(ctx, plain);
+    } fz_catch(ctx) {
+        fz_rethrow(ctx);
+    }
+}
+
+
+// a w x h RGB image, with alpha graded across it when alpha is set
+static fz_image *test_image(fz_context *ctx, int w, int h, int alpha) {
+    fz_pixmap *pixmap = fz_new_pixmap(ctx, fz_device_rgb(ctx), w, h, alpha);
+    fz_image *image = NULL;
+
+    for(int y = 0; y < h; y++) {
+        unsigned char *s = pixmap->samples + (size_t) y * pixmap->stride;
+
+        for(int x = 0; x < w; x++) {
+            unsigned char a = alpha ? (unsigned char) (x * 255 / w) : 0xff;
+
+            // the colour samples don't depend on alpha, so the opaque image's are what the SMasked one stores
+            *s++ = (unsigned char) (x * 7);
+            *s++ = (unsigned char) (y * 5);
+            *s++ = (unsigned char) (x + y);
+
+            if(alpha)
+                *s++ = a;
+        }
+    }
+
+    fz_try(ctx) {
+        image = fz_new_image_from_pixmap(ctx, pixmap, NULL);
+    } fz_always(ctx) {
+        fz_drop_pixmap(ctx, pixmap);
+    } fz_catch(ctx) {
+        fz_rethrow(ctx);
+    }
+
+    return image;
+}
+
+
+static int test_add_image(fz_context *ctx, pdf_document *doc, img_index *index, int alpha) {
+    fz_image *image = test_image(ctx, 48, 32, alpha);
+    pdf_obj *ref = NULL;
+    int num = 0;
+
+    fz_var(ref);
+    fz_try(ctx) {
+        ref = u_pdf_add_image(ctx, doc, index, image, 0);
+        num = pdf_to_num(ctx, ref);
+
+        TEST_CHECK((pdf_dict_get(ctx, ref, PDF_NAME_SMask) != NULL) == alpha);
+    } fz_always(ctx) {
+        pdf_drop_obj(ctx, ref);
+        fz_drop_image(ctx, image);
+    } fz_catch(ctx) {
+        fz_rethrow(ctx);
+    }
+
+    return num;
+}
+
+
+// the same image with alpha is added once, the same colours without it are a different image
+static void test_image_dedupe(fz_context *ctx) {
+    pdf_document *doc = pdf_create_document(ctx);
+    img_index *index = NULL;
+
+    fz_var(index);
+    fz_try(ctx) {
+        index = img_new_index(ctx, doc);
+
+        int masked = test_add_image(ctx, doc, index, 1);
+        TEST_CHECK(masked > 0);
+        TEST_CHECK(test_add_image(ctx, doc, index, 1) == masked);
+
+        int opaque = test_add_image(ctx, doc, index, 0);
+        TEST_CHECK(opaque > 0 && opaque != masked);
+        TEST_CHECK(test_add_image(ctx, doc, index, 0) == opaque);
+
+        img_finish(ctx, doc, index);
+    } fz_always(ctx) {
+        img_drop_index(ctx, index);
+        pdf_drop_document(ctx, doc);
+    } fz_catch(ctx) {
+        fz_rethrow(ctx);
+    }
+}
+
+
+int main(int argc, char **argv) {
+    char dir[] = "/tmp/fillpdf-test-XXXXXX";
+    char path[BATCH_NAME_LEN];
+
+    if(argc != 2) {
+        fprintf(stderr, "usage: fillpdf_test <example dir>\n");
+        return EXIT_FAILURE;
+    }
+
+    fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_UNLIMITED);
+
+    if(ctx == NULL || mkdtemp(dir) == NULL) {
+        fprintf(stderr, "cannot set up the tests\n");
+        return EXIT_FAILURE;
+    }
+
+    fz_try(ctx) {
+        test_copy(ctx, argv[1], dir, "fw9.pdf", path, BATCH_NAME_LEN);
+        test_snapshot(ctx, path);
+        test_sidecar(ctx, path);
+        test_image_dedupe(ctx);
+    } fz_catch(ctx) {
+        fprintf(stderr, "test aborted: %s\n", fz_caught_message(ctx));
+        failed++;
+    }
+
+    char side[BATCH_NAME_LEN];
+    snprintf(side, BATCH_NAME_LEN, "%s/fw9.fxref", dir);
+    unlink(side);
+    unlink(path);
+    rmdir(dir);
+
+    fz_drop_context(ctx);
+
+    if(failed)
+        fprintf(stderr, "%d check(s) failed\n", failed);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
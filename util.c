@@ -6,33 +6,22 @@
 // much of this file is based on mupdf source code
 
 void u_pdf_add_font_res(pdf_env *env, pdf_obj *resources, const char *name, const char *path) {
-    const char *data;
-    int size;
-    fz_font *font;
     pdf_obj *subres, *font_ref;
 
-    data = fz_lookup_base14_font(env->ctx, path, &size);
-    if (data) {
-        font = fz_new_font_from_memory(env->ctx, path, data, size, 0, 0);
-    } else {
-        font = fz_new_font_from_file(env->ctx, NULL, path, 0, 0);
-    }
+    font_ref = fnt_doc_font(env, path);
 
     subres = pdf_dict_get(env->ctx, resources, PDF_NAME_Font);
     if (!subres) {
         subres = pdf_add_object_drop(env->ctx, env->doc, pdf_new_dict(env->ctx, env->doc, 1));
     }
 
-    font_ref = pdf_add_simple_font(env->ctx, env->doc, font);
-    fz_drop_font(env->ctx, font);
-
     pdf_dict_puts(env->ctx, subres, name, font_ref);
     pdf_dict_put(env->ctx, resources, PDF_NAME_Font, subres);
-    pdf_drop_obj(env->ctx, font_ref);
 }
 
 
-pdf_obj *u_pdf_add_image(fz_context *ctx, pdf_document *doc, fz_image *image, int mask) {
+// index holds the images already in doc, see images.c
+pdf_obj *u_pdf_add_image(fz_context *ctx, pdf_document *doc, img_index *index, fz_image *image, int mask) {
     fz_pixmap *pixmap = NULL;
     pdf_obj *imobj = NULL;
     pdf_obj *imref = NULL;
@@ -40,7 +29,8 @@ pdf_obj *u_pdf_add_image(fz_context *ctx, pdf_document *doc, fz_image *image, in
     fz_compression_params *cp = NULL;
     fz_buffer *buffer = NULL;
     fz_colorspace *colorspace = image->colorspace;
-    unsigned char digest[16];
+    img_key key;
+    int deflate_n = 0;
     unsigned char *alpha = NULL;
     /* If we can maintain compression, do so */
     cbuffer = fz_compressed_image_buffer(ctx, image);
@@ -49,51 +39,56 @@ pdf_obj *u_pdf_add_image(fz_context *ctx, pdf_document *doc, fz_image *image, in
         /* Before we add this image as a resource check if the same image
          * already exists in our resources for this doc.  If yes, then
          * hand back that reference */
-        imref = u_pdf_find_image_resource(ctx, doc, image, digest);
+        imref = img_find(ctx, doc, index, image, &key);
         if (imref == NULL) {
             if (cbuffer != NULL && cbuffer->params.type != FZ_IMAGE_PNG && cbuffer->params.type != FZ_IMAGE_TIFF) {
                 buffer = fz_keep_buffer(ctx, cbuffer->buffer);
                 cp = &cbuffer->params;
             } else {
                 unsigned int size;
-                int n;
+                int n, has_alpha;
                 unsigned char *d;
-                unsigned char *ap;
 
-                /* Currently, set to maintain resolution; should we consider
-                 * subsampling here according to desired output res? */
+                /* Resolution is kept, callers resample first with img_fit_dpi */
                 pixmap = fz_get_pixmap_from_image(ctx, image, NULL, NULL, NULL, NULL);
                 colorspace = pixmap->colorspace; /* May be different to image->colorspace! */
-                n = (pixmap->n == 1 ? 1 : pixmap->n - 1);
-                size = image->w * image->h * n;
+                /* An alpha-only pixmap is a mask, its samples are the gray values */
+                has_alpha = pixmap->alpha && pixmap->n > 1;
+                n = pixmap->n - has_alpha;
+                size = pixmap->w * pixmap->h * n;
                 d = fz_malloc(ctx, size);
                 buffer = fz_new_buffer_from_data(ctx, d, size);
 
-                if (pixmap->n == 1) {
-                    memcpy(d, pixmap->samples, size);
+                if (!has_alpha) {
+                    for (int y = 0; y < pixmap->h; y++)
+                        memcpy(d + y * pixmap->w * n, pixmap->samples + y * pixmap->stride, pixmap->w * n);
                 } else {
-                    /* Need to remove the alpha plane */
-                    ap = alpha = fz_malloc(ctx, image->w * image->h);
-                    unsigned char *s = pixmap->samples;
-                    int mod = n;
-                    while (size--)
-                    {
-                        *d++ = *s++;
-                        mod--;
-                        if (mod == 0) {
-                            *ap++ = *s++;
-                            mod = n;
+                    /* Need to remove the alpha plane, an opaque one needs no SMask */
+                    if (!image->mask && !img_alpha_opaque(pixmap->samples, pixmap->stride, pixmap->w, pixmap->h, pixmap->n))
+                        alpha = fz_malloc(ctx, pixmap->w * pixmap->h);
+
+                    img_split_alpha(pixmap->samples, pixmap->stride, pixmap->w, pixmap->h, pixmap->n, d, alpha);
+
+                    if (alpha) {
+                        /* The object gets an SMask, which the index can't hash back to these samples.
+                         * Key it by the samples with their alpha, as the same image added again is */
+                        if (key.pix_state == 0) {
+                            key.pix_hash = u_fz_hash_pixmap(ctx, pixmap);
+                            key.pix_state = 1;
                         }
-                    }
 
-                    if(!image->mask) {
-                        fz_pixmap *mask_pixmap = fz_new_pixmap_from_8bpp_data(ctx, 0, 0, image->w, image->h, alpha, image->w);
+                        fz_pixmap *mask_pixmap = fz_new_pixmap_from_8bpp_data(ctx, 0, 0, pixmap->w, pixmap->h, alpha, pixmap->w);
                         fz_image *mask_img = fz_new_image_from_pixmap(ctx, mask_pixmap, NULL);
+                        fz_drop_pixmap(ctx, mask_pixmap);
                         image->mask = mask_img;
                     }
 
                     fz_free(ctx, alpha);
+                    alpha = NULL;
                 }
+
+                /* Decoded samples are deflated on a thread by img_deflate_stream */
+                deflate_n = n;
             }
 
             imobj = pdf_new_dict(ctx, doc, 3);
@@ -180,13 +175,15 @@ pdf_obj *u_pdf_add_image(fz_context *ctx, pdf_document *doc, fz_image *image, in
             }
 
             if (image->mask)
-                pdf_dict_put_drop(ctx, imobj, PDF_NAME_SMask, pdf_add_image(ctx, doc, image->mask, 0));
+                pdf_dict_put_drop(ctx, imobj, PDF_NAME_SMask, u_pdf_add_image(ctx, doc, index, image->mask, 0));
 
             imref = pdf_add_object(ctx, doc, imobj);
-            pdf_update_stream(ctx, doc, imref, buffer, 1);
+            if (deflate_n)
+                img_deflate_stream(ctx, doc, index, imref, buffer, pixmap->w, pixmap->h, deflate_n);
+            else
+                pdf_update_stream(ctx, doc, imref, buffer, 1);
 
-            /* Add ref to our image resource hash table. */
-            imref = pdf_insert_image_resource(ctx, doc, digest, imref);
+            img_insert(ctx, index, imref, &key);
 
         }
     }
@@ -206,91 +203,75 @@ pdf_obj *u_pdf_add_image(fz_context *ctx, pdf_document *doc, fz_image *image, in
 
 
 
-pdf_obj *u_pdf_find_image_resource(fz_context *ctx, pdf_document *doc, fz_image *item, unsigned char digest[16]) {
-    pdf_obj *res;
-
-    if (!doc->resources.images) {
-        doc->resources.images = fz_new_hash_table(ctx, 4096, 16, -1);
-        u_pdf_preload_image_resources(ctx, doc);
-    }
-
-    /* Create md5 and see if we have the item in our table */
-    u_fz_md5_image(ctx, item, digest);
-    res = fz_hash_find(ctx, doc->resources.images, digest);
-    if (res)
-        pdf_keep_obj(ctx, res);
-    return res;
-}
-
-void u_pdf_preload_image_resources(fz_context *ctx, pdf_document *doc) {
-    int len, k;
-    pdf_obj *obj;
-    pdf_obj *type;
-    pdf_obj *res = NULL;
-    fz_image *image = NULL;
-    unsigned char digest[16];
+// the fingerprint of a pixmap's samples, alpha included, with XXH64
+uint64_t u_fz_hash_pixmap_xxh64(fz_context *ctx, fz_pixmap *pixmap) {
+    int h = pixmap->h;
+    unsigned char *d = pixmap->samples;
+    hsh_state state;
 
-    fz_try(ctx)
+    hsh_init(&state, 0);
+    if (pixmap->stride == pixmap->w * pixmap->n)
     {
-        len = pdf_count_objects(ctx, doc);
-
-        for (k = 1; k < len; k++) {
-            obj = pdf_new_indirect(ctx, doc, k, 0);
-
-            type = pdf_dict_get(ctx, obj, PDF_NAME_Subtype);
-            if (pdf_name_eq(ctx, type, PDF_NAME_Image))
-            {
-                image = pdf_load_image(ctx, doc, obj);
-                u_fz_md5_image(ctx, image, digest);
-                fz_drop_image(ctx, image);
-                image = NULL;
-
-                /* Do not allow overwrites. */
-                if (!fz_hash_find(ctx, doc->resources.images, digest))
-                    fz_hash_insert(ctx, doc->resources.images, digest, pdf_keep_obj(ctx, obj));
-            }
-            pdf_drop_obj(ctx, obj);
-            obj = NULL;
-        }
+        hsh_update(&state, d, (size_t) pixmap->stride * h);
     }
-    fz_always(ctx)
+    else while (h--)
     {
-        fz_drop_image(ctx, image);
-        pdf_drop_obj(ctx, obj);
-    }
-    fz_catch(ctx)
-    {
-        fz_rethrow(ctx);
+        hsh_update(&state, d, pixmap->w * pixmap->n);
+        d += pixmap->stride;
     }
+    return hsh_final(&state);
 }
 
 
-void u_fz_md5_image(fz_context *ctx, fz_image *image, unsigned char digest[16]) {
-    fz_pixmap *pixmap;
+// the former MD5 fingerprint, folded to 64 bits. kept for IMAGE_HASH_MD5 builds and the bench
+uint64_t u_fz_hash_pixmap_md5(fz_context *ctx, fz_pixmap *pixmap) {
+    uint64_t hash;
+    int h = pixmap->h;
+    unsigned char *d = pixmap->samples;
     fz_md5 state;
-    int h;
-    unsigned char *d;
+    unsigned char digest[16];
 
-    pixmap = fz_get_pixmap_from_image(ctx, image, NULL, NULL, 0, 0);
     fz_md5_init(&state);
-    d = pixmap->samples;
-    h = pixmap->h;
     while (h--)
     {
         fz_md5_update(&state, d, pixmap->w * pixmap->n);
         d += pixmap->stride;
     }
     fz_md5_final(&state, digest);
+    memcpy(&hash, digest, sizeof(hash));
+    return hash;
+}
+
+
+uint64_t u_fz_hash_pixmap(fz_context *ctx, fz_pixmap *pixmap) {
+#ifdef IMAGE_HASH_MD5
+    return u_fz_hash_pixmap_md5(ctx, pixmap);
+#else
+    return u_fz_hash_pixmap_xxh64(ctx, pixmap);
+#endif
+}
+
+
+// the pixel fingerprint of an image
+uint64_t u_fz_hash_image(fz_context *ctx, fz_image *image) {
+    fz_pixmap *pixmap = fz_get_pixmap_from_image(ctx, image, NULL, NULL, 0, 0);
+    uint64_t hash = u_fz_hash_pixmap(ctx, pixmap);
+
     fz_drop_pixmap(ctx, pixmap);
+    return hash;
 }
 
 
-void u_pdf_sign_signature(fz_context *ctx, pdf_document *doc, pdf_widget *widget, const char *sigfile, const char *password, vg_pathlist *pathlist, const char *overlay_msg) {
-    pdf_signer *signer = pdf_read_pfx(ctx, sigfile, password);
+// signer is a decoded certificate borrowed from the signer cache, when NULL the pfx in sigfile is read
+void u_pdf_sign_signature(fz_context *ctx, pdf_document *doc, pdf_widget *widget, pdf_signer *signer, const char *sigfile, const char *password, vg_pathlist *pathlist, const char *overlay_msg) {
+    pdf_signer *owned = NULL;
+
+    if(signer == NULL)
+        signer = owned = pdf_read_pfx(ctx, sigfile, password);
+
     pdf_designated_name *dn = NULL;
     fz_buffer *fzbuf = NULL;
 
-    fz_var(signer);
     fz_var(dn);
     fz_var(fzbuf);
     fz_try(ctx)
@@ -330,7 +311,7 @@ void u_pdf_sign_signature(fz_context *ctx, pdf_document *doc, pdf_widget *widget
             u_pdf_set_signature_appearance(ctx, doc, (pdf_annot *)widget, pathlist, overlay_msg);
         }
     } fz_always(ctx) {
-        pdf_drop_signer(ctx, signer);
+        pdf_drop_signer(ctx, owned);
         if(dn != NULL) pdf_drop_designated_name(ctx, dn);
         if(fzbuf != NULL) fz_drop_buffer(ctx, fzbuf);
     } fz_catch(ctx) {
@@ -887,21 +868,3 @@ void u_pdf_set_signature_appearance(fz_context *ctx, pdf_document *doc, pdf_anno
         fz_rethrow(ctx);
     }
 }
-
-fz_buffer *u_pdf_deflatebuf(fz_context *ctx, unsigned char *p, int n) {
-    fz_buffer *buf;
-    unsigned char *data;
-    int t;
-    uLongf csize = compressBound(n);
-
-
-    data = fz_malloc(ctx, csize);
-    buf = fz_new_buffer_from_data(ctx, data, csize);
-    t = compress(data, &csize, p, n);
-    if (t != Z_OK) {
-        fz_drop_buffer(ctx, buf);
-        fz_throw(ctx, FZ_ERROR_GENERIC, "cannot deflate buffer");
-    }
-    fz_resize_buffer(ctx, buf, csize);
-    return buf;
-}
@@ -0,0 +1,253 @@
+#include <mupdf/fitz.h>
+#include <mupdf/pdf.h>
+#include <jansson.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "fill.h"
+
+// a small thread pool for the fill engine. each worker has its own cloned mupdf context and a deque of
+// work items. the producer deals items round robin, workers take from the head of their own deque and
+// steal from the tail of the others' when it runs dry.
+
+
+static pthread_mutex_t work_fz_mutexes[FZ_LOCK_MAX];
+
+static void work_fz_lock(void *user, int lock) {
+    pthread_mutex_lock(&work_fz_mutexes[lock]);
+}
+
+static void work_fz_unlock(void *user, int lock) {
+    pthread_mutex_unlock(&work_fz_mutexes[lock]);
+}
+
+static fz_locks_context work_fz_locks = { NULL, work_fz_lock, work_fz_unlock };
+
+
+// the locks mupdf needs before a context can be cloned for other threads
+fz_locks_context *work_fz_locks_context() {
+    static int initialised = 0;
+
+    if(!initialised) {
+        for(int i = 0; i < FZ_LOCK_MAX; i++)
+            pthread_mutex_init(&work_fz_mutexes[i], NULL);
+
+        initialised = 1;
+    }
+
+    return &work_fz_locks;
+}
+
+
+static void work_deque_init(work_deque *deque) {
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->cap = INIT_CAP;
+    deque->head = deque->len = 0;
+    deque->items = malloc(sizeof(work_item *) * deque->cap);
+}
+
+static void work_deque_free(work_deque *deque) {
+    pthread_mutex_destroy(&deque->lock);
+    free(deque->items);
+}
+
+static void work_deque_push(work_deque *deque, work_item *item) {
+    pthread_mutex_lock(&deque->lock);
+
+    if(deque->len == deque->cap) {
+        work_item **items = malloc(sizeof(work_item *) * deque->cap * 2);
+
+        for(int i = 0; i < deque->len; i++)
+            items[i] = deque->items[(deque->head + i) % deque->cap];
+
+        free(deque->items);
+        deque->items = items;
+        deque->head = 0;
+        deque->cap *= 2;
+    }
+
+    deque->items[(deque->head + deque->len) % deque->cap] = item;
+    deque->len++;
+
+    pthread_mutex_unlock(&deque->lock);
+}
+
+// owners take the oldest item, thieves the newest
+static work_item *work_deque_take(work_deque *deque, int steal) {
+    work_item *item = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if(deque->len > 0) {
+        if(steal) {
+            item = deque->items[(deque->head + deque->len - 1) % deque->cap];
+        } else {
+            item = deque->items[deque->head];
+            deque->head = (deque->head + 1) % deque->cap;
+        }
+
+        deque->len--;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return item;
+}
+
+
+static work_item *work_next_item(work_pool *pool, int worker_num) {
+    work_item *item;
+
+    while(1) {
+        item = work_deque_take(&pool->deques[worker_num], 0);
+
+        for(int i = 1; item == NULL && i < pool->count; i++)
+            item = work_deque_take(&pool->deques[(worker_num + i) % pool->count], 1);
+
+        pthread_mutex_lock(&pool->wait_lock);
+
+        if(item) {
+            pool->queued--;
+            pthread_cond_signal(&pool->space_cond);
+        } else {
+            while(pool->queued == 0 && !pool->closed)
+                pthread_cond_wait(&pool->items_cond, &pool->wait_lock);
+
+            if(pool->queued == 0 && pool->closed) {
+                pthread_mutex_unlock(&pool->wait_lock);
+                return NULL;
+            }
+        }
+
+        pthread_mutex_unlock(&pool->wait_lock);
+
+        if(item)
+            return item;
+    }
+}
+
+
+static void *work_thread(void *arg) {
+    work_thread_env *wenv = arg;
+    work_pool *pool = wenv->pool;
+    work_item *item;
+
+    while((item = work_next_item(pool, wenv->worker_num)) != NULL) {
+        wenv->result += pool->func(&wenv->env, pool->shared, item);
+        free(item->line);
+        free(item);
+    }
+
+    return NULL;
+}
+
+
+// start count workers, each with a copy of env holding its own cloned context.
+// the context in env must have been created with work_fz_locks_context()
+work_pool *work_new_pool(pdf_env *env, int count, work_func func, void *shared) {
+    work_pool *pool = malloc(sizeof(work_pool));
+    memset(pool, 0, sizeof(work_pool));
+
+    pool->func = func;
+    pool->shared = shared;
+    pool->max_queued = count * WORK_QUEUE_DEPTH;
+
+    pthread_mutex_init(&pool->wait_lock, NULL);
+    pthread_cond_init(&pool->items_cond, NULL);
+    pthread_cond_init(&pool->space_cond, NULL);
+
+    pool->deques = malloc(sizeof(work_deque) * count);
+    pool->threads = malloc(sizeof(work_thread_env) * count);
+
+    // running workers read count to find deques to steal from, so it's set before any starts
+    for(int i = 0; i < count; i++) {
+        work_thread_env *wenv = &pool->threads[i];
+
+        memcpy(&wenv->env, env, sizeof(pdf_env));
+        wenv->env.ctx = fz_clone_context(env->ctx);
+        wenv->env.doc = NULL;
+        wenv->env.page = NULL;
+        wenv->env.snapshot = NULL;
+        wenv->env.doc_fonts = NULL;
+        wenv->env.doc_font_len = wenv->env.doc_font_cap = 0;
+        wenv->pool = pool;
+        wenv->worker_num = i;
+        wenv->result = 0;
+
+        if(wenv->env.ctx == NULL) {
+            fprintf(stderr, "cannot clone mupdf context for worker %d\n", i);
+            break;
+        }
+
+        work_deque_init(&pool->deques[i]);
+        pool->count++;
+    }
+
+    // items are only dealt to started workers, the others' deques stay empty
+    for(int i = 0; i < pool->count; i++) {
+        if(pthread_create(&pool->threads[i].thread, NULL, work_thread, &pool->threads[i]) != 0) {
+            fprintf(stderr, "cannot start worker %d\n", i);
+            break;
+        }
+
+        pool->started++;
+    }
+
+    if(pool->started == 0) {
+        work_pool_finish(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+
+// queue an item, blocking while the workers are WORK_QUEUE_DEPTH items each behind
+void work_pool_push(work_pool *pool, work_item *item) {
+    pthread_mutex_lock(&pool->wait_lock);
+
+    while(pool->queued >= pool->max_queued)
+        pthread_cond_wait(&pool->space_cond, &pool->wait_lock);
+
+    // published and counted under one hold, a worker can't take the item before it's counted
+    work_deque_push(&pool->deques[pool->next_deque], item);
+    pool->next_deque = (pool->next_deque + 1) % pool->started;
+
+    pool->queued++;
+    pthread_cond_signal(&pool->items_cond);
+    pthread_mutex_unlock(&pool->wait_lock);
+}
+
+
+// wait for the queued items to be processed, free the pool and return the sum of the work_func results
+int work_pool_finish(work_pool *pool) {
+    int result = 0;
+
+    pthread_mutex_lock(&pool->wait_lock);
+    pool->closed = 1;
+    pthread_cond_broadcast(&pool->items_cond);
+    pthread_mutex_unlock(&pool->wait_lock);
+
+    for(int i = 0; i < pool->count; i++) {
+        if(i < pool->started)
+            pthread_join(pool->threads[i].thread, NULL);
+
+        result += pool->threads[i].result;
+
+        snap_drop(pool->threads[i].env.ctx, pool->threads[i].env.snapshot);
+        fnt_free_doc_fonts(&pool->threads[i].env);
+        fz_drop_context(pool->threads[i].env.ctx);
+        work_deque_free(&pool->deques[i]);
+    }
+
+    pthread_cond_destroy(&pool->items_cond);
+    pthread_cond_destroy(&pool->space_cond);
+    pthread_mutex_destroy(&pool->wait_lock);
+
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+
+    return result;
+}
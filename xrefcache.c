@@ -0,0 +1,345 @@
+#include <mupdf/fitz.h>
+#include <mupdf/pdf.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fill.h"
+
+// xref sidecars. 'fillpdf xref' opens a pdf, loads every object so mupdf repairs a broken xref, and writes the
+// resolved offset table and the trailer next to it as input.fxref. while the pdf's size,
+// mtime and XXH64 still match, cmplt_read_input appends the table to the base as one complete xref section without
+// a /Prev, so mupdf reads it in place of the file's own xref and never falls back to a repair scan.
+//
+// a table with objects in object streams is appended as an unfiltered xref stream, otherwise as a classic table.
+// the appended section is part of the base, outputs carry it. a mapped base is mapped again with the section
+// after it, the file's pages are still shared. matching the sidecar hashes the whole pdf, once per process.
+
+
+static void xrc_name(const char *input, char *buf, int buflen) {
+    int len = strlen(input);
+
+    len = (len > 4 && strcmp(input + len - 4, ".pdf") == 0) ? len - 4 : len;
+    snprintf(buf, buflen, "%.*s.fxref", len, input);
+}
+
+
+static fz_buffer *xrc_read(fz_context *ctx, const char *path) {
+    fz_buffer *buf = mm_map_file(ctx, path);
+    fz_stream *stm = NULL;
+
+    if(buf)
+        return buf;
+
+    fz_var(stm);
+    fz_try(ctx) {
+        stm = fz_open_file(ctx, path);
+        buf = fz_read_all(ctx, stm, 0);
+    } fz_always(ctx) {
+        fz_drop_stream(ctx, stm);
+    } fz_catch(ctx) {
+        fz_rethrow(ctx);
+    }
+
+    return buf;
+}
+
+
+static void xrc_put_be(unsigned char *p, int64_t v, int bytes) {
+    while(bytes-- > 0) {
+        p[bytes] = v & 0xff;
+        v >>= 8;
+    }
+}
+
+
+// append the section to out, which holds the base_len bytes of the pdf the table was made from
+static void xrc_write_tail(fz_context *ctx, fz_buffer *out, size_t base_len, xrc_header *header, xrc_row *rows, const char *trailer) {
+    int n = header->row_count;
+    int64_t xref_ofs = base_len + 1;
+    int stream = 0, w2 = 1;
+    char line[64];
+
+    for(int i = 0; i < n && !stream; i++)
+        stream = rows[i].type == 2;
+
+    // every offset is before the section
+    while(w2 < 8 && (xref_ofs >> (w2 * 8)) != 0)
+        w2++;
+
+    fz_write_buffer(ctx, out, "\n", 1);
+
+    if(stream) {
+        snprintf(line, sizeof(line), "%d 0 obj\n<</Type/XRef/Size %d/W[1 %d 2]/Length %d", n, n + 1, w2, (n + 1) * (3 + w2));
+        fz_write_buffer(ctx, out, line, strlen(line));
+    } else {
+        snprintf(line, sizeof(line), "xref\n0 %d\n", n);
+        fz_write_buffer(ctx, out, line, strlen(line));
+
+        for(int i = 0; i < n; i++) {
+            if(rows[i].type == 1)
+                snprintf(line, sizeof(line), "%010lld %05d n\r\n", (long long) rows[i].field2, rows[i].field3);
+            else
+                snprintf(line, sizeof(line), "%010d %05d f\r\n", 0, rows[i].field3);
+
+            fz_write_buffer(ctx, out, line, 20);
+        }
+
+        snprintf(line, sizeof(line), "trailer\n<</Size %d", n);
+        fz_write_buffer(ctx, out, line, strlen(line));
+    }
+
+    // the trailer was saved as a whole dictionary, its << is already written
+    fz_write_buffer(ctx, out, trailer + 2, strlen(trailer + 2));
+
+    if(stream) {
+        unsigned char row[1 + 8 + 2];
+
+        fz_write_buffer(ctx, out, "\nstream\n", 8);
+
+        // the last row is the xref stream's own
+        for(int i = 0; i <= n; i++) {
+            row[0] = i < n ? rows[i].type : 1;
+            xrc_put_be(row + 1, i < n ? rows[i].field2 : xref_ofs, w2);
+            xrc_put_be(row + 1 + w2, i < n ? rows[i].field3 : 0, 2);
+            fz_write_buffer(ctx, out, row, 3 + w2);
+        }
+
+        fz_write_buffer(ctx, out, "\nendstream\nendobj", 17);
+    }
+
+    snprintf(line, sizeof(line), "\nstartxref\n%lld\n%%%%EOF\n", (long long) xref_ofs);
+    fz_write_buffer(ctx, out, line, strlen(line));
+}
+
+
+static void xrc_write_file(const char *output, xrc_header *header, xrc_row *rows, const char *trailer, int *ok) {
+    FILE *out = fopen(output, "w");
+
+    if(!out) {
+        fprintf(stderr, "Unable to write xref cache '%s'\n", output);
+        *ok = 0;
+        return;
+    }
+
+    fwrite(header, sizeof(xrc_header), 1, out);
+    fwrite(rows, sizeof(xrc_row), header->row_count, out);
+    fwrite(trailer, 1, header->trailer_len, out);
+
+    *ok = fclose(out) == 0;
+}
+
+
+// the xref command, writes input's sidecar
+int xrc_write(fz_context *ctx, const char *input) {
+    pdf_obj *drop_keys[] = { PDF_NAME_Size, PDF_NAME_Prev, PDF_NAME_XRefStm, PDF_NAME_Type, PDF_NAME_W,
+                             PDF_NAME_Index, PDF_NAME_Length, PDF_NAME_Filter, PDF_NAME_DecodeParms };
+    char output[BATCH_NAME_LEN];
+    struct stat st;
+    xrc_header header;
+    fz_buffer *base = NULL, *trailer = NULL;
+    fz_output *out = NULL;
+    pdf_document *doc = NULL;
+    pdf_obj *dict = NULL;
+    xrc_row *rows = NULL;
+    int ok = 0;
+
+    xrc_name(input, output, BATCH_NAME_LEN);
+
+    if(stat(input, &st) != 0) {
+        fprintf(stderr, "Unable to read '%s'\n", input);
+        return 0;
+    }
+
+    memset(&header, 0, sizeof(xrc_header));
+
+    fz_var(base);
+    fz_var(trailer);
+    fz_var(out);
+    fz_var(doc);
+    fz_var(dict);
+    fz_var(rows);
+    fz_try(ctx) {
+        unsigned char *data;
+        size_t len;
+
+        base = xrc_read(ctx, input);
+        len = fz_buffer_storage(ctx, base, &data);
+        doc = cmplt_open_buffer(ctx, base);
+
+        // mupdf repairs the xref when an object isn't where the table says, so every object is loaded once
+        for(int num = 1; num < pdf_xref_len(ctx, doc); num++) {
+            pdf_xref_entry *entry = pdf_get_xref_entry(ctx, doc, num);
+
+            fz_try(ctx) {
+                if(entry->type == 'n' || entry->type == 'o')
+                    pdf_drop_obj(ctx, pdf_load_object(ctx, doc, num, entry->type == 'n' ? entry->gen : 0));
+            } fz_catch(ctx) {
+                // left to mupdf as it would be without the cache
+            }
+        }
+
+        header.row_count = pdf_xref_len(ctx, doc);
+        rows = fz_malloc_array(ctx, header.row_count, sizeof(xrc_row));
+
+        for(int num = 0; num < (int) header.row_count; num++) {
+            pdf_xref_entry *entry = pdf_get_xref_entry(ctx, doc, num);
+            xrc_row *row = &rows[num];
+
+            if(num > 0 && entry->type == 'n' && entry->ofs > 0 && (size_t) entry->ofs < len) {
+                row->type = 1;
+                row->field2 = entry->ofs;
+                row->field3 = entry->gen;
+            } else if(num > 0 && entry->type == 'o') {
+                row->type = 2;
+                row->field2 = entry->ofs;
+                row->field3 = entry->gen;
+            } else {
+                row->type = 0;
+                row->field2 = 0;
+                row->field3 = num == 0 ? 65535 : entry->gen;
+            }
+        }
+
+        // the table's own keys are written with it when it's loaded
+        dict = pdf_copy_dict(ctx, pdf_trailer(ctx, doc));
+        for(int i = 0; i < (int) (sizeof(drop_keys) / sizeof(drop_keys[0])); i++)
+            pdf_dict_del(ctx, dict, drop_keys[i]);
+
+        trailer = fz_new_buffer(ctx, 256);
+        out = fz_new_output_with_buffer(ctx, trailer);
+        pdf_print_obj(ctx, out, dict, 1);
+        fz_write_buffer(ctx, trailer, "", 1);
+
+        unsigned char *text;
+        header.trailer_len = fz_buffer_storage(ctx, trailer, &text);
+
+        if(header.trailer_len < 5 || memcmp(text, "<<", 2) != 0)
+            fz_throw(ctx, FZ_ERROR_GENERIC, "cannot read trailer");
+
+        memcpy(header.magic, XRC_MAGIC, 4);
+        header.version = XRC_VERSION;
+        header.file_size = len;
+        header.mtime_sec = st.st_mtim.tv_sec;
+        header.mtime_nsec = st.st_mtim.tv_nsec;
+        header.file_hash = hsh_bytes(data, len);
+        header.repaired = doc->repair_attempted;
+
+        xrc_write_file(output, &header, rows, (const char *) text, &ok);
+    } fz_always(ctx) {
+        fz_drop_output(ctx, out);
+        fz_drop_buffer(ctx, trailer);
+        pdf_drop_obj(ctx, dict);
+        pdf_drop_document(ctx, doc);
+        mm_drop_buffer(ctx, base);
+        fz_free(ctx, rows);
+    } fz_catch(ctx) {
+        fprintf(stderr, "cannot index '%s': %s\n", input, fz_caught_message(ctx));
+        return 0;
+    }
+
+    if(ok)
+        fprintf(stderr, "Indexed %d objects to %s%s\n", header.row_count, output,
+                header.repaired ? ", the xref needed repair" : "");
+
+    return ok;
+}
+
+
+static int xrc_valid(fz_context *ctx, xrc_header *header, size_t size, struct stat *st, fz_buffer *base) {
+    unsigned char *data;
+    size_t len = fz_buffer_storage(ctx, base, &data);
+
+    if(size < sizeof(xrc_header) || memcmp(header->magic, XRC_MAGIC, 4) != 0 || header->version != XRC_VERSION)
+        return 0;
+
+    size_t expected = sizeof(xrc_header) + sizeof(xrc_row) * (size_t) header->row_count + header->trailer_len;
+
+    if(expected != size || header->row_count == 0 || header->trailer_len < 5)
+        return 0;
+
+    const char *trailer = (const char *) header + expected - header->trailer_len;
+    if(trailer[header->trailer_len - 1] != '\0')
+        return 0;
+
+    // the cheap checks first, the hash reads the whole pdf
+    if(header->file_size != len || (uint64_t) st->st_size != len
+       || header->mtime_sec != st->st_mtim.tv_sec || header->mtime_nsec != st->st_mtim.tv_nsec)
+        return 0;
+
+    return header->file_hash == hsh_bytes(data, len);
+}
+
+
+// base read from path, with path's xref sidecar appended when there's one that matches it. base is dropped if
+// a new buffer is returned. a sidecar that can't be used is reported and the base returned as it is
+fz_buffer *xrc_apply(fz_context *ctx, const char *path, fz_buffer *base) {
+    char name[BATCH_NAME_LEN];
+    struct stat st, side_st;
+    fz_buffer *result = NULL, *tail = NULL;
+
+    xrc_name(path, name, BATCH_NAME_LEN);
+
+    int fd = open(name, O_RDONLY);
+
+    // no sidecar, the usual case
+    if(fd < 0)
+        return base;
+
+    if(fstat(fd, &side_st) != 0 || side_st.st_size == 0 || stat(path, &st) != 0) {
+        close(fd);
+        return base;
+    }
+
+    void *map = mmap(NULL, side_st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(map == MAP_FAILED)
+        return base;
+
+    xrc_header *header = map;
+
+    if(!xrc_valid(ctx, header, side_st.st_size, &st, base)) {
+        fprintf(stderr, "Ignoring xref cache '%s', it doesn't match '%s'\n", name, path);
+        munmap(map, side_st.st_size);
+        return base;
+    }
+
+    xrc_row *rows = (xrc_row *) (header + 1);
+    const char *trailer = (const char *) (rows + header->row_count);
+
+    fz_var(result);
+    fz_var(tail);
+    fz_try(ctx) {
+        unsigned char *data, *tail_data;
+        size_t len = fz_buffer_storage(ctx, base, &data);
+
+        tail = fz_new_buffer(ctx, 20 * (size_t) header->row_count + header->trailer_len + 256);
+        xrc_write_tail(ctx, tail, len, header, rows, trailer);
+        size_t tail_len = fz_buffer_storage(ctx, tail, &tail_data);
+
+        // a mapped base stays mapped, only the page the file ends in is copied
+        if(mm_is_mapped(ctx, base))
+            result = mm_map_file_tail(ctx, path, &st, tail_data, tail_len);
+
+        if(result == NULL) {
+            result = fz_new_buffer(ctx, len + tail_len);
+            fz_write_buffer(ctx, result, data, len);
+            fz_write_buffer(ctx, result, tail_data, tail_len);
+        }
+    } fz_always(ctx) {
+        fz_drop_buffer(ctx, tail);
+        munmap(map, side_st.st_size);
+    } fz_catch(ctx) {
+        fprintf(stderr, "Ignoring xref cache '%s': %s\n", name, fz_caught_message(ctx));
+        mm_drop_buffer(ctx, result);
+        return base;
+    }
+
+    mm_drop_buffer(ctx, base);
+
+    return result;
+}
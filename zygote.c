@@ -0,0 +1,174 @@
+#include <mupdf/fitz.h>
+#include <mupdf/pdf.h>
+#include <jansson.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "fill.h"
+
+// the zygote command. every form named in the config file is warmed up once by form_load, then each job
+// read from stdin is filled by a forked child which shares the warm state copy-on-write, saves the output and exits.
+
+typedef struct {
+    pid_t pid;
+    int line_num;
+    char *output;
+} zyg_child;
+
+
+// runs in the forked child, the return value is the exit status
+static int zyg_fill_job(pdf_env *env, fill_form *form, json_t *data, const char *output) {
+    int retval = EXIT_SUCCESS;
+
+    env->doc = form->doc;
+    env->files.output = (char *) output;
+
+    fz_try(env->ctx) {
+        int updated_doc = cmplt_fill_pages(env, form->template, data);
+
+        cmplt_save(env, form->base, updated_doc);
+    } fz_catch(env->ctx) {
+        fprintf(stderr, "cannot fill '%s': %s\n", output, fz_caught_message(env->ctx));
+        retval = EXIT_FAILURE;
+    }
+
+    return retval;
+}
+
+
+static void zyg_report(zyg_child *child, int status) {
+    int ok = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+    json_t *report = json_object();
+
+    json_object_set_new(report, "line", json_integer(child->line_num));
+    json_object_set_new(report, "output", json_string(child->output));
+    json_object_set_new(report, "status", json_string(ok ? "ok" : "failed"));
+
+    if(WIFSIGNALED(status))
+        json_object_set_new(report, "signal", json_integer(WTERMSIG(status)));
+
+    json_dumpf(report, stdout, JSON_COMPACT);
+    fprintf(stdout, "\n");
+    fflush(stdout);
+
+    json_decref(report);
+    free(child->output);
+    child->pid = 0;
+}
+
+
+// wait for one child to exit and report it. returns 0 when there are no children left
+static int zyg_reap(zyg_child *children, int max_children) {
+    int status;
+    pid_t pid = waitpid(-1, &status, 0);
+
+    if(pid <= 0)
+        return 0;
+
+    for(int i = 0; i < max_children; i++) {
+        if(children[i].pid == pid) {
+            zyg_report(&children[i], status);
+            break;
+        }
+    }
+
+    return 1;
+}
+
+
+void zyg_run(pdf_env *env) {
+    json_error_t json_err;
+    const char *form_name;
+    json_t *form_conf;
+    char *line = NULL;
+    size_t line_cap = 0;
+    int line_num = 0, running = 0;
+    int max_children = env->fill.jobs > 0 ? env->fill.jobs : 1;
+
+    json_t *config = json_load_file(env->files.input, 0, &json_err);
+
+    if(!json_is_object(config)) {
+        fprintf(stderr, "Invalid zygote config '%s'. json root must be an object.\n", env->files.input);
+        json_decref(config);
+        return;
+    }
+
+    int form_count = 0;
+    fill_form *forms = malloc(sizeof(fill_form) * json_object_size(config));
+    zyg_child *children = malloc(sizeof(zyg_child) * max_children);
+    memset(children, 0, sizeof(zyg_child) * max_children);
+
+    json_object_foreach(config, form_name, form_conf) {
+        if(form_load(env, &forms[form_count], form_name, form_conf, 1))
+            form_count++;
+        else
+            form_drop(env, &forms[form_count]);
+    }
+
+    while(getline(&line, &line_cap, stdin) != -1) {
+        line_num++;
+
+        if(strspn(line, " \t\r\n") == strlen(line))
+            continue;
+
+        json_t *job = json_loads(line, 0, &json_err);
+        json_t *json_form = json_object_get(job, "form");
+        json_t *json_output = json_object_get(job, "output");
+        json_t *data = json_object_get(job, "data");
+        fill_form *form = NULL;
+
+        if(json_is_string(json_form)) {
+            for(int i = 0; i < form_count; i++) {
+                if(strcmp(forms[i].name, json_string_value(json_form)) == 0)
+                    form = &forms[i];
+            }
+        }
+
+        if(form == NULL || !json_is_string(json_output) || !json_is_object(data)) {
+            fprintf(stderr, "Skipping job on line %d: needs a known 'form', an 'output' file name and a 'data' object\n", line_num);
+            json_decref(job);
+            continue;
+        }
+
+        while(running >= max_children && zyg_reap(children, max_children))
+            running--;
+
+        fflush(stdout);
+        fflush(stderr);
+
+        pid_t pid = fork();
+
+        if(pid == 0) {
+            _exit(zyg_fill_job(env, form, data, json_string_value(json_output)));
+        } else if(pid < 0) {
+            perror("fork");
+        } else {
+            for(int i = 0; i < max_children; i++) {
+                if(children[i].pid == 0) {
+                    children[i].pid = pid;
+                    children[i].line_num = line_num;
+                    children[i].output = strdup(json_string_value(json_output));
+                    break;
+                }
+            }
+
+            running++;
+        }
+
+        json_decref(job);
+    }
+
+    while(running > 0 && zyg_reap(children, max_children))
+        running--;
+
+    for(int i = 0; i < form_count; i++)
+        form_drop(env, &forms[i]);
+
+    free(line);
+    free(children);
+    free(forms);
+    json_decref(config);
+}